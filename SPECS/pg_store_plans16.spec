@@ -16,7 +16,7 @@
 ## Set general information for pg_store_plans.
 Summary:    Record executed plans on PostgreSQL 16
 Name:       pg_store_plans16
-Version:    1.8
+Version:    1.9
 Release:    1%{?dist}
 License:    BSD
 Group:      Applications/Databases
@@ -39,7 +39,7 @@ Note that this package is available for only PostgreSQL 16.
 
 %package llvmjit
 Requires: postgresql16-server, postgresql16-llvmjit
-Requires: pg_store_plans16 = 1.8
+Requires: pg_store_plans16 = 1.9
 Summary:  Just-in-time compilation support for pg_store_plans16
 
 %description llvmjit
@@ -76,6 +76,7 @@ rm -rf %{buildroot}
 %{_libdir}/pg_store_plans.so
 %defattr(0644,root,root)
 %{_datadir}/extension/pg_store_plans--1.8.sql
+%{_datadir}/extension/pg_store_plans--1.8--1.9.sql
 %{_datadir}/extension/pg_store_plans.control
 
 %files llvmjit
@@ -85,6 +86,8 @@ rm -rf %{buildroot}
 
 # History of pg_store_plans.
 %changelog
+* Fri Oct 16 2026 agent
+- Version 1.9. Add collisions to pg_store_plans_info.
 * Fri Feb 02 2024 Kyotaro Horiguchi
 - Version 1.8. Support PostgreSQL 16.
 * Wed Dec 14 2022 Kyotaro Horiguchi
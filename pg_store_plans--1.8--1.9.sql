@@ -0,0 +1,22 @@
+/* pg_store_plans/pg_store_plans--1.8--1.9.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_store_plans UPDATE TO '1.9'" to load this file. \quit
+
+--- Add collisions to pg_store_plans_info
+DROP VIEW pg_store_plans_info;
+DROP FUNCTION pg_store_plans_info();
+
+CREATE FUNCTION pg_store_plans_info(
+    OUT dealloc bigint,
+    OUT stats_reset timestamp with time zone,
+    OUT collisions bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pg_store_plans_info AS
+  SELECT * FROM pg_store_plans_info();
+
+GRANT SELECT ON pg_store_plans_info TO PUBLIC;
@@ -18,9 +18,9 @@
  *
  * Plans are identified by fingerprinting plan representations in
  * "shortened" JSON format with constants and unstable values such as
- * rows, width, loops ignored. Nevertheless, stored plan entries hold
- * them of the latest execution. Entry eviction is done in the same
- * way to pg_stat_statements.
+ * rows, width, loops ignored, or optionally by fingerprinting plan trees
+ * directly. Nevertheless, stored plan entries hold them of the latest
+ * execution. Entry eviction is done in the same way to pg_stat_statements.
  *
  * Copyright (c) 2008-2024, PostgreSQL Global Development Group
  * Copyright (c) 2012-2024, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
@@ -32,45 +32,72 @@
  */
 #include "postgres.h"
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dlfcn.h>
 #include <math.h>
 
 #include "catalog/pg_authid.h"
+#include "commands/dbcommands.h"
+#include "common/pg_lzcompress.h"
 #include "commands/explain.h"
 #include "access/hash.h"
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
 #if PG_VERSION_NUM >= 90500
 #include "access/parallel.h"
 #endif
+#include "access/xact.h"
 #include "executor/instrument.h"
 #include "funcapi.h"
+#if PG_VERSION_NUM >= 150000
+#include "lib/dshash.h"
+#endif
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
 #include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lwlock.h"
 #include "storage/spin.h"
 #include "storage/shmem.h"
+#include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 #include "utils/acl.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
 #if PG_VERSION_NUM >= 160000
 #include "nodes/queryjumble.h"
 #elif PG_VERSION_NUM >= 140000
 #include "utils/queryjumble.h"
 #endif
+#include "utils/memutils.h"
 #include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 100000
+#include "utils/varlena.h"
+#endif
 
 #include "pgsp_json.h"
 #include "pgsp_explain.h"
+#include "pgsp_planid.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
 
 PG_MODULE_MAGIC;
 
 /* Location of stats file */
 #define PGSP_DUMP_FILE	"global/pg_store_plans.stat"
 #define PGSP_TEXT_FILE	PG_STAT_TMP_DIR "/pgsp_plan_texts.stat"
+#define PGSP_GC_TEXT_FILE	PG_STAT_TMP_DIR "/pgsp_plan_texts.stat.gc"
 
 #if PG_VERSION_NUM < 90500
 #define		IsParallelWorker()		(false)
@@ -80,7 +107,7 @@ PG_MODULE_MAGIC;
 static const uint32 PGSP_PG_MAJOR_VERSION = PG_VERSION_NUM / 100;
 
 /* This constant defines the magic number in the stats file header */
-static const uint32 PGSP_FILE_HEADER = 0x20221214;
+static const uint32 PGSP_FILE_HEADER = 0x20261019;
 static int max_plan_len = 5000;
 
 /* XXX: Should USAGE_EXEC reflect execution time and/or buffer usage? */
@@ -91,6 +118,12 @@ static int max_plan_len = 5000;
 #define USAGE_DECREASE_FACTOR	(0.99)	/* decreased every entry_dealloc */
 #define STICKY_DECREASE_FACTOR	(0.50)	/* factor for sticky entries */
 #define USAGE_DEALLOC_PERCENT	5		/* free this % of entries at once */
+#define PGSP_MAX_PARTITIONS		128		/* max # of hashtable partitions */
+#define PGSP_MIN_PARTITION_SIZE	100		/* min # of entries per partition */
+#define PGSP_DSA_INITIAL_SIZE	(1024 * 1024)	/* initial dynamic table area */
+#define PGSP_CAPTURE_BLOCK_SIZE	(64 * 1024)	/* memory kept for plan capture */
+#define FAST_VERIFY_RATE		(0.05)	/* fraction of fast executions whose
+										 * plan ids are verified */
 
 /* In PostgreSQL 11, queryid becomes a uint64 internally. */
 #if PG_VERSION_NUM >= 110000
@@ -124,7 +157,7 @@ typedef struct pgspHashKey
 	Oid			userid;			/* user OID */
 	Oid			dbid;			/* database OID */
 	queryid_t	queryid;		/* query identifier */
-	uint32		planid;			/* plan identifier */
+	uint64		planid;			/* plan identifier */
 } pgspHashKey;
 
 /*
@@ -155,17 +188,39 @@ typedef struct Counters
 									   in msec */
 	double		temp_blk_write_time;/* time spent writing temp blocks,
 									   in msec */
+	bool		buffers_collected;	/* buffer usage has been collected */
 	TimestampTz	first_call;			/* timestamp of first call  */
 	TimestampTz	last_call;			/* timestamp of last call  */
 	double		usage;				/* usage factor */
 } Counters;
 
+/*
+ * Additive counters of an entry, which are updated by atomic operations
+ * without holding the mutex of the entry.  The fields with the same names in
+ * the Counters of the entry are not used.
+ */
+typedef struct pgspAtomicCounters
+{
+	pg_atomic_uint64 rows;
+	pg_atomic_uint64 shared_blks_hit;
+	pg_atomic_uint64 shared_blks_read;
+	pg_atomic_uint64 shared_blks_dirtied;
+	pg_atomic_uint64 shared_blks_written;
+	pg_atomic_uint64 local_blks_hit;
+	pg_atomic_uint64 local_blks_read;
+	pg_atomic_uint64 local_blks_dirtied;
+	pg_atomic_uint64 local_blks_written;
+	pg_atomic_uint64 temp_blks_read;
+	pg_atomic_uint64 temp_blks_written;
+} pgspAtomicCounters;
+
 /*
  * Global statistics for pg_store_plans
  */
 typedef struct pgspGlobalStats
 {
 	int64		dealloc;		/* # of times entries were deallocated */
+	int64		collisions;		/* # of times plan id collisions detected */
 	TimestampTz stats_reset;	/* timestamp with all stats reset */
 } pgspGlobalStats;
 
@@ -178,18 +233,72 @@ typedef struct pgspEntry
 {
 	pgspHashKey	key;			/* hash key of entry - MUST BE FIRST */
 	Counters	counters;		/* the statistics for this query */
-	Size		plan_offset;	/* plan text offset in extern file */
+	pgspAtomicCounters acounters;	/* additive statistics for this query */
+	Size		plan_offset;	/* plan text offset in extern file, or
+								 * dsa_pointer to it in DSA storage */
 	int			plan_len;		/* # of valid bytes in query string */
 	int			encoding;		/* query encoding */
-	slock_t		mutex;			/* protects the counters only */
+	uint32		plan_check;		/* check value of the plan, to detect
+								 * plan id collisions */
+	bool		text_shared;	/* references a shared plan text */
+	slock_t		mutex;			/* protects the counters except acounters */
 } pgspEntry;
 
+/*
+ * Plan texts in the external file are shared among the entries of the same
+ * plan of a query, which differ only in user or database.  The shared text
+ * table maps them to the text stored first.
+ */
+typedef struct pgspTextKey
+{
+	queryid_t	queryid;		/* query identifier */
+	uint64		planid;			/* plan identifier */
+	int			encoding;		/* plan encoding */
+} pgspTextKey;
+
+typedef struct pgspPlanText
+{
+	pgspTextKey	key;			/* hash key of text - MUST BE FIRST */
+	Size		plan_offset;	/* plan text offset in extern file */
+	int			plan_len;		/* # of valid bytes in plan text */
+	int			refcount;		/* # of entries referencing this text */
+	int			gc_count;		/* gc cycle that last moved this text */
+} pgspPlanText;
+
+/*
+ * Values of plan_offset of entries in the dump file, telling whether the plan
+ * text follows the entry.
+ */
+#define DUMP_TEXT_PRIVATE	0	/* plan text follows */
+#define DUMP_TEXT_SHARED	1	/* plan text follows, used by later entries */
+#define DUMP_TEXT_REFERENCE	2	/* same text as a previous entry's */
+
+/* New location of a plan text moved by background gc */
+typedef struct pgspMovedText
+{
+	Size		old_offset;		/* offset in old file - MUST BE FIRST */
+	Size		new_offset;		/* offset in new file */
+} pgspMovedText;
+
+/* Shared plan text written to or read from the dump file */
+typedef struct pgspDumpedText
+{
+	pgspTextKey	key;			/* hash key of text - MUST BE FIRST */
+	char	   *plan;			/* plan text read, when loading */
+	int			plan_len;		/* # of valid bytes in plan */
+} pgspDumpedText;
+
 /*
  * Global shared state
  */
 typedef struct pgspSharedState
 {
-	LWLock	   *lock;			/* protects hashtable search/modification */
+	LWLockPadded *locks;		/* protect hashtable partitions */
+	LWLock	   *queue_lock;		/* protects plan queue and writer_latch */
+	LWLock	   *flush_lock;		/* held while writing out queued plans */
+	LWLock	   *text_lock;		/* protects shared plan text table */
+	Latch	   *writer_latch;	/* latch of plan writer, if running */
+	Size		queue_len;		/* # of used bytes in plan queue */
 	int			plan_size;		/* max query length in bytes */
 	double		cur_median_usage;	/* current median usage in hashtable */
 	Size		mean_plan_len;	/* current mean entry text length */
@@ -197,9 +306,43 @@ typedef struct pgspSharedState
 	Size		extent;			/* current extent of plan file */
 	int			n_writers;		/* number of active writers to query file */
 	int			gc_count;		/* plan file garbage collection cycle count */
+	bool		gc_running;		/* background gc is in progress */
+	Size		gc_boundary;	/* extent when the running gc started */
+	long		text_table_size;	/* max # of shared plan texts */
 	pgspGlobalStats stats;		/* global statistics for pgsp */
+	long		num_entries;	/* # of entries in dynamic hash table */
+#if PG_VERSION_NUM >= 150000
+	int			dsa_tranche;	/* LWLock tranche of dynamic table area */
+	int			dsh_tranche;	/* LWLock tranche of dynamic hash table */
+	dshash_table_handle dsh_handle;	/* handle of dynamic hash table */
+	bool		dsh_loaded;		/* saved entries are loaded into it */
+#endif
 } pgspSharedState;
 
+/*
+ * Plan text queued to be written out by plan writer. The plan text follows
+ * this header terminated by NUL.
+ */
+typedef struct pgspQueuedPlan
+{
+	Size		plan_offset;	/* reserved offset in plan text file */
+	int			plan_len;		/* # of bytes in plan text */
+} pgspQueuedPlan;
+
+#define QUEUED_PLAN_SIZE(len) \
+	MAXALIGN(sizeof(pgspQueuedPlan) + (len) + 1)
+
+/*
+ * Counters of an entry accumulated locally in a backend, when
+ * pg_store_plans.flush_interval is set.  Only entries known to exist in the
+ * shared hash table have this.
+ */
+typedef struct pgspPendingEntry
+{
+	pgspHashKey	key;			/* hash key of entry - MUST BE FIRST */
+	Counters	counters;		/* counters not yet flushed */
+} pgspPendingEntry;
+
 /*---- Local variables ----*/
 
 /* Current nesting depth of ExecutorRun+ProcessUtility calls */
@@ -215,7 +358,67 @@ static ProcessUtility_hook_type prev_ProcessUtility = NULL;
 
 /* Links to shared memory state */
 static pgspSharedState *shared_state = NULL;
-static HTAB *hash_table = NULL;
+static HTAB *hash_tables[PGSP_MAX_PARTITIONS];
+static HTAB *text_table = NULL;
+static char *gc_pbuffer = NULL;		/* plan text file mapped by background gc */
+static Size gc_pbuffer_size = 0;
+static char *plan_queue = NULL;
+
+/* # of hashtable partitions and max # of entries in each partition */
+static int	num_partitions = 1;
+static int	partition_size;
+
+#define PARTITION_LOCK(part)	(&shared_state->locks[(part)].lock)
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * DSA area in the main shared memory, holding the dynamic hash table used
+ * instead of hash_tables and plan texts, if enabled
+ */
+static void *dsa_place = NULL;
+static dsa_area *dsh_area = NULL;
+static dshash_table *dsh_table = NULL;
+#endif
+
+/*
+ * Entries live in DSA, which the postmaster cannot access.  Plan writer loads
+ * and saves them instead.
+ */
+#define ENTRIES_IN_DSA() \
+	(dynamic_table || plan_storage == PLAN_STORAGE_DSA)
+
+/* The hash table is available in this process */
+#define TABLE_READY() \
+	(shared_state != NULL && (dynamic_table || hash_tables[0] != NULL))
+
+/*
+ * Scan over the entries of a partition, for either kind of hash table.
+ */
+typedef struct pgspEntryScan
+{
+	HTAB	   *htab;			/* fixed hash table being scanned */
+	HASH_SEQ_STATUS hash_seq;	/* scan on the fixed hash table */
+#if PG_VERSION_NUM >= 150000
+	dshash_seq_status dsh_seq;	/* scan on the dynamic hash table */
+	bool		dsh_active;		/* dsh_seq has not been terminated */
+#endif
+} pgspEntryScan;
+
+/* Flag set by signal handler of plan writer */
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+/* Backend-local pending counters and the last time they were flushed */
+static HTAB *pending_table = NULL;
+static TimestampTz last_flush = 0;
+
+/*
+ * Memory context for plan capture, which is reset after every capture, and
+ * the length of the last EXPLAIN output to size the output buffer with.
+ */
+static MemoryContext capture_context = NULL;
+static bool capturing = false;
+static int	last_explain_len = 0;
 
 /*---- GUC variables ----*/
 
@@ -259,21 +462,116 @@ static const struct config_enum_entry plan_formats[] =
 typedef enum
 {
 	PLAN_STORAGE_SHMEM,		/* plan is stored as a part of hash entry */
-	PLAN_STORAGE_FILE		/* plan is stored in a separate file */
+	PLAN_STORAGE_FILE,		/* plan is stored in a separate file */
+	PLAN_STORAGE_DSA		/* plan is stored in a chunk in DSA */
 }  pgspPlanStorage;
 
 static const struct config_enum_entry plan_storage_options[] =
 {
 	{"shmem", PLAN_STORAGE_SHMEM, false},
 	{"file", PLAN_STORAGE_FILE, false},
+#if PG_VERSION_NUM >= 150000
+	{"dsa", PLAN_STORAGE_DSA, false},
+#endif
+	{NULL, 0, false}
+};
+
+/* options for compression of stored plan texts */
+typedef enum
+{
+	PLAN_COMPRESSION_NONE,	/* plan is stored as is */
+	PLAN_COMPRESSION_PGLZ,	/* plan is compressed by pglz */
+	PLAN_COMPRESSION_LZ4	/* plan is compressed by LZ4 */
+}  pgspPlanCompression;
+
+static const struct config_enum_entry plan_compression_options[] =
+{
+	{"none", PLAN_COMPRESSION_NONE, false},
+	{"pglz", PLAN_COMPRESSION_PGLZ, false},
+#ifdef USE_LZ4
+	{"lz4", PLAN_COMPRESSION_LZ4, false},
+#endif
+	{NULL, 0, false}
+};
+
+/*
+ * A compressed plan text starts with one of the following bytes, which never
+ * start a JSON text, followed by the length of the original text.
+ */
+#define PLAN_COMPRESSED_PGLZ	'\x01'
+#define PLAN_COMPRESSED_LZ4		'\x02'
+#define PLAN_COMPRESSED_HDRSZ	((int) (1 + sizeof(int32)))
+#define PLAN_COMPRESS_MIN_LEN	64		/* shorter plans are stored as is */
+
+/* options for plan id calculation */
+typedef enum
+{
+	PLAN_FINGERPRINT_JSON,	/* hash of normalized EXPLAIN JSON output */
+	PLAN_FINGERPRINT_TREE	/* hash calculated directly from plan tree */
+}  pgspPlanFingerprint;
+
+static const struct config_enum_entry plan_fingerprint_options[] =
+{
+	{"json", PLAN_FINGERPRINT_JSON, false},
+	{"tree", PLAN_FINGERPRINT_TREE, false},
+	{NULL, 0, false}
+};
+
+/* options for aggregation of entries across users or databases */
+typedef enum
+{
+	AGGREGATE_NONE = 0,			/* separate entries per user and database */
+	AGGREGATE_USERS = 1,		/* entries shared by users */
+	AGGREGATE_DATABASES = 2,	/* entries shared by databases */
+	AGGREGATE_ALL = 3			/* entries shared by users and databases */
+}  pgspAggregate;
+
+static const struct config_enum_entry aggregate_options[] =
+{
+	{"none", AGGREGATE_NONE, false},
+	{"users", AGGREGATE_USERS, false},
+	{"databases", AGGREGATE_DATABASES, false},
+	{"all", AGGREGATE_ALL, false},
+	{NULL, 0, false}
+};
+
+/* options for instrumentation of tracked statements */
+typedef enum
+{
+	INSTRUMENT_LEVEL_TIMER,		/* execution time and rows only */
+	INSTRUMENT_LEVEL_BUFFERS	/* and buffer usage */
+}  pgspInstrumentLevel;
+
+static const struct config_enum_entry instrument_options[] =
+{
+	{"timer", INSTRUMENT_LEVEL_TIMER, false},
+	{"buffers", INSTRUMENT_LEVEL_BUFFERS, false},
 	{NULL, 0, false}
 };
 
 static int	store_size;			/* max # statements to track */
+static int	hash_partitions;	/* max # of hashtable partitions */
+static bool dynamic_table = false;	/* use resizable hash table in DSA */
 static int	track_level = TRACK_LEVEL_TOP;		/* tracking level */
 static int	min_duration;		/* min duration to record */
+static bool count_fast;			/* count executions shorter than min_duration */
+static bool fold_appends;		/* fold children of Append in plan ids */
+static bool mask_temp_schemas;	/* mask temporary schemas in plan ids */
+static char *mask_relation_names = NULL;	/* relation names to mask */
+static int	relname_patterns_generation = 0;	/* advanced on every change
+												 * of the patterns */
+static int	planid_cache_size;	/* max # of cached plan ids per backend */
+static double sample_rate;		/* fraction of executions to verify plan id */
+static bool sample_adaptive;	/* adjust sample rate for each query */
+static bool plan_writer;		/* write plan texts in background worker */
+static int	writer_queue_size;	/* size of plan queue in kB */
+static int	writer_delay;		/* plan writer sleep time in ms */
+static bool background_gc;		/* compact plan texts into a new file */
+static int	flush_interval;		/* interval of flushing local counters */
 static bool dump_on_shutdown;	/* whether to save stats across shutdown */
 static bool log_analyze;		/* Similar to EXPLAIN (ANALYZE *) */
+static double analyze_sample_rate;	/* fraction of executions to analyze */
+static int	analyze_min_interval;	/* min interval of analyzing a query */
 static bool log_verbose;		/* Similar to EXPLAIN (VERBOSE *) */
 static bool log_buffers;		/* Similar to EXPLAIN (BUFFERS *) */
 static bool log_timing;			/* Similar to EXPLAIN (TIMING *) */
@@ -281,11 +579,54 @@ static bool log_triggers;		/* whether to log trigger statistics  */
 static int  plan_format= PLAN_FORMAT_TEXT;		/* Plan representation style in
 								 * pg_store_plans.plan  */
 static int  plan_storage = PLAN_STORAGE_FILE;	/* Plan storage type */
+static int  plan_compression = PLAN_COMPRESSION_NONE;	/* Compression of
+														 * stored plans */
+static int  plan_fingerprint = PLAN_FINGERPRINT_JSON;	/* Plan id calculation
+													 * method */
+static int  instrument_level = INSTRUMENT_LEVEL_BUFFERS;	/* Instrumentation
+															 * to collect */
+static int  aggregate = AGGREGATE_NONE;	/* key columns omitted from entries */
+
+
+/* lists of databases, roles and queries to track or ignore */
+static char *track_databases = NULL;
+static char *ignore_databases = NULL;
+static char *track_roles = NULL;
+static char *ignore_roles = NULL;
+static char *track_queryids = NULL;
+static char *ignore_queryids = NULL;
+
+/* Sorted array of query ids, kept as the extra of queryid list GUCs */
+typedef struct pgspQueryIdList
+{
+	int			nids;			/* # of query ids */
+	int64		ids[FLEXIBLE_ARRAY_MEMBER];	/* sorted query ids */
+} pgspQueryIdList;
 
+static pgspQueryIdList *track_queryid_list = NULL;
+static pgspQueryIdList *ignore_queryid_list = NULL;
+
+/*
+ * Result of the database and role filters for the current user. It is
+ * recalculated when the user or the generation, which is advanced by any
+ * change of the lists, differs from the ones it was calculated for.
+ */
+static uint32 filter_generation = 1;
+static uint32 filter_checked_generation = 0;
+static Oid	filter_checked_userid = InvalidOid;
+static bool filter_passed = true;
 
 /* disables tracking overriding track_level */
 static bool force_disabled = false;
 
+/* executions are analyzed only when sampled */
+#define ANALYZE_SAMPLING() \
+	(analyze_sample_rate < 1.0 || analyze_min_interval > 0)
+
+/* plan texts are written out by plan writer */
+#define PLAN_WRITER_ENABLED() \
+	(plan_writer && plan_storage == PLAN_STORAGE_FILE)
+
 #if PG_VERSION_NUM >= 140000
 /*
  * For pg14 and later, we rely on core queryid calculation.  If
@@ -297,12 +638,14 @@ static bool force_disabled = false;
 	(!force_disabled &&											  \
 	 (track_level >= TRACK_LEVEL_ALL ||							  \
 	  (track_level == TRACK_LEVEL_TOP && nested_level == 0)) &&	  \
-	 (q != PGSP_NO_QUERYID))
+	 (q != PGSP_NO_QUERYID) &&									  \
+	 pgsp_filter(q))
 #else
 #define pgsp_enabled(q) \
 	(!force_disabled &&											\
 	 (track_level >= TRACK_LEVEL_ALL ||							\
-	  (track_level == TRACK_LEVEL_TOP && nested_level == 0)))
+	  (track_level == TRACK_LEVEL_TOP && nested_level == 0)) &&	\
+	 pgsp_filter(q))
 #endif
 
 #define SHMEM_PLAN_PTR(ent) (((char *) ent) + sizeof(pgspEntry))
@@ -312,6 +655,8 @@ static bool force_disabled = false;
 void		_PG_init(void);
 void		_PG_fini(void);
 
+PGDLLEXPORT void pgsp_writer_main(Datum main_arg);
+
 Datum		pg_store_plans_reset(PG_FUNCTION_ARGS);
 Datum		pg_store_plans_hash_query(PG_FUNCTION_ARGS);
 Datum		pg_store_plans(PG_FUNCTION_ARGS);
@@ -353,6 +698,8 @@ static shmem_request_hook_type prev_shmem_request_hook = NULL;
 static void pgsp_shmem_request(void);
 static void pgsp_shmem_startup(void);
 static void pgsp_shmem_shutdown(int code, Datum arg);
+static void entries_load(FILE *pfile);
+static bool entries_dump(void);
 static void pgsp_ExecutorStart(QueryDesc *queryDesc, int eflags);
 static void pgsp_ExecutorRun(QueryDesc *queryDesc,
 				 ScanDirection direction,
@@ -367,23 +714,105 @@ static void pgsp_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 					QueryEnvironment *queryEnv,
 					DestReceiver *dest, COMPTAG_TYPE *completionTag);
 static uint32 hash_query(const char* query);
-static void pgsp_store(char *plan, queryid_t queryId,
+static char *pgsp_explain_plan(QueryDesc *queryDesc);
+static void pgsp_capture(QueryDesc *queryDesc, queryid_t queryId,
+						 double total_time, uint64 rows,
+						 const BufferUsage *bufusage, bool fast);
+static void pgsp_store(QueryDesc *queryDesc, queryid_t queryId,
 		   double total_time, uint64 rows,
-		   const BufferUsage *bufusage);
+		   const BufferUsage *bufusage, bool fast);
+static void counters_set(Counters *counters, double total_time, uint64 rows,
+						 const BufferUsage *bufusage);
+static void counters_accum(volatile Counters *counters, const Counters *delta);
+static void counters_accum_additive(Counters *counters, const Counters *delta);
+static void atomic_counters_init(pgspAtomicCounters *acounters,
+								 const Counters *counters);
+static void atomic_counters_add(pgspAtomicCounters *acounters,
+								const Counters *delta);
+static void atomic_counters_read(pgspAtomicCounters *acounters,
+								 Counters *counters);
+static void entry_update(pgspEntry *entry, const Counters *delta);
+static void count_collision(pgspHashKey *key);
+static pgspPendingEntry *pending_find(pgspHashKey *key, bool create);
+static void pending_flush(bool force);
+static void pending_discard(void);
+static void pgsp_xact_callback(XactEvent event, void *arg);
+static void pgsp_pending_exit(int code, Datum arg);
 static void pg_store_plans_internal(FunctionCallInfo fcinfo,
 									pgspVersion api_version);
 static Size shared_mem_size(void);
+static int	entry_partition(pgspHashKey *key);
+static void lock_all_partitions(LWLockMode mode);
+static void release_all_partitions(void);
+#if PG_VERSION_NUM >= 150000
+static void dsh_params(dshash_parameters *params);
+static void dsh_create(void);
+static void dsh_attach_area(void);
+static void dsh_attach(void);
+#endif
+static pgspEntry *entry_find(int part, pgspHashKey *key);
+static pgspEntry *entry_enter(int part, pgspHashKey *key, bool *found);
+static void entry_remove(int part, pgspHashKey *key);
+static long partition_num_entries(int part);
+static void entry_scan_init(pgspEntryScan *scan, int part, bool exclusive);
+static pgspEntry *entry_scan_next(pgspEntryScan *scan);
+static void entry_scan_term(pgspEntryScan *scan);
+static void entry_scan_remove(pgspEntryScan *scan, pgspEntry *entry);
 static pgspEntry *entry_alloc(pgspHashKey *key, Size plan_offset, int plan_len,
-							  bool sticky);
+							  uint32 plan_check, bool sticky);
+static void entry_refresh_plan(int part, pgspHashKey *key, const char *plan);
+static char *plan_compress(char *plan, int *plan_len, int encoding);
+static int	plan_compress_bytes(const char *plan, int plan_len, char *dest);
+static char *plan_decompress(char *plan, int plan_len);
+static bool ptext_behind_gc(Size plan_offset);
 static bool ptext_store(const char *plan, int plan_len, Size *plan_offset,
 						int *gc_count);
+static bool ptext_enqueue(const char *plan, int plan_len, Size plan_offset);
+static void ptext_flush(void);
+static void ptext_write_queue(bool lock);
 static char *ptext_load_file(Size *buffer_size);
+static char *ptext_map_file(Size *buffer_size);
+static void ptext_unmap_file(char *buffer, Size buffer_size);
 static char *ptext_fetch(Size plan_offset, int plan_len, char *buffer,
 						 Size buffer_size);
+static void ptext_make_key(pgspTextKey *tkey, pgspHashKey *key,
+						   int encoding);
+static bool ptext_lookup(pgspHashKey *key, Size *plan_offset, int *plan_len);
+static void ptext_ref(pgspEntry *entry);
+static void ptext_unref(pgspEntry *entry);
+static void ptext_update(pgspEntry *entry);
+static void ptext_forget_all(void);
+static void ptext_release(pgspEntry *entry);
+static bool ptext_dsa_store(const char *plan, int plan_len, Size *plan_offset);
+static char *ptext_dsa_fetch(Size plan_offset, int plan_len);
+static void ptext_dsa_free(Size plan_offset);
+static char *entry_plan_text(pgspEntry *entry, char *pbuffer,
+							 Size pbuffer_size);
 static bool need_gc_ptexts(void);
 static void gc_ptexts(void);
-static void entry_dealloc(void);
+static void gc_ptexts_background(void);
+static bool gc_ptexts_copy(Size boundary, int gc_count);
+static bool gc_copy_ptext(HTAB *moved, FILE *pfile, Size *extent,
+						  char *pbuffer, Size pbuffer_size, Size boundary,
+						  Size plan_offset, int plan_len);
+static bool gc_moved_offset(HTAB *moved, Size boundary, Size tail_len,
+							Size new_tail, Size *plan_offset, int plan_len);
+static void gc_unmap_file(void);
+static void run_gc_ptexts(void);
+static void entry_dealloc(int part);
+static void entry_trim(void);
 static void entry_reset(void);
+static bool pgsp_filter(queryid_t queryid);
+static bool name_in_list(const char *name, const char *list);
+static bool queryid_in_list(int64 queryid, pgspQueryIdList *list);
+static bool check_name_list(char **newval, void **extra, GucSource source);
+static void assign_name_list(const char *newval, void *extra);
+static bool check_queryid_list(char **newval, void **extra, GucSource source);
+static void assign_track_queryids(const char *newval, void *extra);
+static void assign_ignore_queryids(const char *newval, void *extra);
+static bool check_relname_patterns(char **newval, void **extra,
+								   GucSource source);
+static void assign_relname_patterns(const char *newval, void *extra);
 
 /*
  * Module load callback
@@ -412,6 +841,20 @@ _PG_init(void)
 	/*
 	 * Define (or redefine) custom GUC variables.
 	 */
+#if PG_VERSION_NUM >= 150000
+	DefineCustomBoolVariable("pg_store_plans.dynamic_table",
+	  "Keeps plans in a hash table resizable without restart.",
+							 NULL,
+							 &dynamic_table,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+#endif
+
+	/* The dynamic hash table can be resized at any time */
 	DefineCustomIntVariable("pg_store_plans.max",
 	  "Sets the maximum number of plans tracked by pg_store_plans.",
 							NULL,
@@ -419,6 +862,19 @@ _PG_init(void)
 							1000,
 							100,
 							INT_MAX,
+							dynamic_table ? PGC_SIGHUP : PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_store_plans.partitions",
+	  "Sets the maximum number of partitions of the hash table.",
+							NULL,
+							&hash_partitions,
+							16,
+							1,
+							PGSP_MAX_PARTITIONS,
 							PGC_POSTMASTER,
 							0,
 							NULL,
@@ -450,6 +906,66 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomEnumVariable("pg_store_plans.plan_compression",
+			   "Selects the compression method of stored plan texts.",
+							 NULL,
+							 &plan_compression,
+							 PLAN_COMPRESSION_NONE,
+							 plan_compression_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_store_plans.plan_writer",
+			   "Writes plan texts in a background worker.",
+							 NULL,
+							 &plan_writer,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_store_plans.background_gc",
+			   "Compacts the plan text file without blocking other sessions.",
+							 NULL,
+							 &background_gc,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_store_plans.writer_queue_size",
+	  "Sets the size of the queue of plan texts to be written by plan writer.",
+							NULL,
+							&writer_queue_size,
+							1024,
+							64,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_store_plans.writer_delay",
+	  "Plan writer sleep time between rounds in milliseconds.",
+							NULL,
+							&writer_delay,
+							200,
+							10,
+							10000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomEnumVariable("pg_store_plans.track",
 			   "Selects which plans are tracked by pg_store_plans.",
 							 NULL,
@@ -462,6 +978,84 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomStringVariable("pg_store_plans.track_databases",
+							   "Databases whose statements are tracked. Empty means all.",
+							   NULL,
+							   &track_databases,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT | GUC_LIST_QUOTE,
+							   check_name_list,
+							   assign_name_list,
+							   NULL);
+
+	DefineCustomStringVariable("pg_store_plans.ignore_databases",
+							   "Databases whose statements are not tracked.",
+							   NULL,
+							   &ignore_databases,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT | GUC_LIST_QUOTE,
+							   check_name_list,
+							   assign_name_list,
+							   NULL);
+
+	DefineCustomStringVariable("pg_store_plans.track_roles",
+							   "Roles whose statements are tracked. Empty means all.",
+							   NULL,
+							   &track_roles,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT | GUC_LIST_QUOTE,
+							   check_name_list,
+							   assign_name_list,
+							   NULL);
+
+	DefineCustomStringVariable("pg_store_plans.ignore_roles",
+							   "Roles whose statements are not tracked.",
+							   NULL,
+							   &ignore_roles,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT | GUC_LIST_QUOTE,
+							   check_name_list,
+							   assign_name_list,
+							   NULL);
+
+	DefineCustomStringVariable("pg_store_plans.track_queryids",
+							   "Query ids to be tracked. Empty means all.",
+							   NULL,
+							   &track_queryids,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT,
+							   check_queryid_list,
+							   assign_track_queryids,
+							   NULL);
+
+	DefineCustomStringVariable("pg_store_plans.ignore_queryids",
+							   "Query ids not to be tracked.",
+							   NULL,
+							   &ignore_queryids,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT,
+							   check_queryid_list,
+							   assign_ignore_queryids,
+							   NULL);
+
+	DefineCustomEnumVariable("pg_store_plans.aggregate",
+			   "Selects across which of users and databases entries are shared.",
+							 NULL,
+							 &aggregate,
+							 AGGREGATE_NONE,
+							 aggregate_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomEnumVariable("pg_store_plans.plan_format",
 			   "Selects which format to be appied for plan representation in pg_store_plans.",
 							 NULL,
@@ -474,6 +1068,101 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomEnumVariable("pg_store_plans.plan_fingerprint",
+			   "Selects how plan ids are calculated.",
+							 NULL,
+							 &plan_fingerprint,
+							 PLAN_FINGERPRINT_JSON,
+							 plan_fingerprint_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_store_plans.fold_appends",
+		   "Folds children of Append nodes in plan id calculation.",
+							 NULL,
+							 &fold_appends,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_store_plans.mask_temp_schemas",
+		   "Masks temporary schemas and tables in plan id calculation.",
+							 NULL,
+							 &mask_temp_schemas,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_store_plans.mask_relation_names",
+		   "Patterns of relation names masked in plan id calculation.",
+							   NULL,
+							   &mask_relation_names,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT | GUC_LIST_QUOTE,
+							   check_relname_patterns,
+							   assign_relname_patterns,
+							   NULL);
+
+	DefineCustomIntVariable("pg_store_plans.planid_cache_size",
+					"Sets the maximum number of plan ids cached in a backend.",
+							NULL,
+							&planid_cache_size,
+							1000,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_store_plans.sample_rate",
+		   "Fraction of executions whose plan id is verified once known.",
+							 NULL,
+							 &sample_rate,
+							 1.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_store_plans.sample_adaptive",
+		   "Lowers the sample rate of each query while its plan stays the same.",
+							 NULL,
+							 &sample_adaptive,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_store_plans.flush_interval",
+	  "Sets the interval of flushing counters accumulated in backends.",
+							NULL,
+							&flush_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomIntVariable("pg_store_plans.min_duration",
 					"Minimum duration to record plan in milliseconds.",
 							NULL,
@@ -487,6 +1176,17 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomBoolVariable("pg_store_plans.count_fast_executions",
+		   "Counts executions shorter than min_duration without explaining them.",
+							 NULL,
+							 &count_fast,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomBoolVariable("pg_store_plans.save",
 			   "Save pg_store_plans statistics across server shutdowns.",
 							 NULL,
@@ -498,6 +1198,18 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomEnumVariable("pg_store_plans.instrument",
+							 "Selects which instrumentation is collected for tracked statements.",
+							 "Buffer usage columns are reported as NULL for entries executed only with \"timer\".",
+							 &instrument_level,
+							 INSTRUMENT_LEVEL_BUFFERS,
+							 instrument_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomBoolVariable("pg_store_plans.log_analyze",
 							 "Use EXPLAIN ANALYZE for plan logging.",
 							 NULL,
@@ -509,6 +1221,32 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomRealVariable("pg_store_plans.analyze_sample_rate",
+		   "Fraction of executions to be analyzed when log_analyze is on.",
+							 NULL,
+							 &analyze_sample_rate,
+							 1.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_store_plans.analyze_min_interval",
+	  "Sets the minimum interval of analyzed executions of each query.",
+							NULL,
+							&analyze_min_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomBoolVariable("pg_store_plans.log_buffers",
 							 "Log buffer usage.",
 							 NULL,
@@ -555,14 +1293,46 @@ _PG_init(void)
 
 	EmitWarningsOnPlaceholders("pg_store_plans");
 
-#if PG_VERSION_NUM < 150000	
-	pgsp_shmem_request();
-#endif
+	/*
+	 * Partition the hash table so that each partition has a reasonable number
+	 * of entries to evict from.  The dynamic hash table is not partitioned
+	 * since its size may change, but dshash has its own partitioned locking
+	 * for lookups.
+	 */
+	if (dynamic_table)
+		num_partitions = 1;
+	else
+		num_partitions = Max(1, Min(hash_partitions,
+									store_size / PGSP_MIN_PARTITION_SIZE));
+	partition_size = (store_size + num_partitions - 1) / num_partitions;
 
 	/*
-	 * Install hooks.
+	 * Register plan writer if requested.  It also loads and saves entries in
+	 * DSA, since the postmaster cannot access it.
 	 */
-#if PG_VERSION_NUM >= 150000
+	if (PLAN_WRITER_ENABLED() || ENTRIES_IN_DSA())
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = 10;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_store_plans");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgsp_writer_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_store_plans writer");
+		snprintf(worker.bgw_type, BGW_MAXLEN, "pg_store_plans writer");
+		RegisterBackgroundWorker(&worker);
+	}
+
+#if PG_VERSION_NUM < 150000	
+	pgsp_shmem_request();
+#endif
+
+	/*
+	 * Install hooks.
+	 */
+#if PG_VERSION_NUM >= 150000
 	prev_shmem_request_hook = shmem_request_hook;
 	shmem_request_hook = pgsp_shmem_request;
 #endif
@@ -608,7 +1378,7 @@ pgsp_shmem_request(void)
 #endif
 
 	RequestAddinShmemSpace(shared_mem_size());
-	RequestNamedLWLockTranche("pg_store_plans", 1);
+	RequestNamedLWLockTranche("pg_store_plans", num_partitions + 3);
 }
 
 /*
@@ -620,22 +1390,22 @@ pgsp_shmem_startup(void)
 {
 	bool		found;
 	HASHCTL		info;
-	FILE	   *file = NULL;
 	FILE	   *pfile = NULL;
-	uint32		header;
-	int32		num;
-	int32		pgver;
 	int32		i;
-	int			plan_size;
-	int			buffer_size;
-	char	   *buffer = NULL;
 
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
 
 	/* reset in case this is a restart within the postmaster */
 	shared_state = NULL;
-	hash_table = NULL;
+	memset(hash_tables, 0, sizeof(hash_tables));
+	text_table = NULL;
+	plan_queue = NULL;
+#if PG_VERSION_NUM >= 150000
+	dsa_place = NULL;
+	dsh_area = NULL;
+	dsh_table = NULL;
+#endif
 
 	/*
 	 * Create or attach to the shared memory state, including hash table
@@ -649,7 +1419,14 @@ pgsp_shmem_startup(void)
 	if (!found)
 	{
 		/* First time through ... */
-		shared_state->lock = &(GetNamedLWLockTranche("pg_store_plans"))->lock;
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_store_plans");
+
+		shared_state->locks = locks;
+		shared_state->queue_lock = &locks[num_partitions].lock;
+		shared_state->flush_lock = &locks[num_partitions + 1].lock;
+		shared_state->text_lock = &locks[num_partitions + 2].lock;
+		shared_state->writer_latch = NULL;
+		shared_state->queue_len = 0;
 		shared_state->plan_size = max_plan_len;
 		shared_state->cur_median_usage = ASSUMED_MEDIAN_INIT;
 		shared_state->mean_plan_len = ASSUMED_LENGTH_INIT;
@@ -657,22 +1434,76 @@ pgsp_shmem_startup(void)
 		shared_state->extent = 0;
 		shared_state->n_writers = 0;
 		shared_state->gc_count = 0;
+		shared_state->gc_running = false;
+		shared_state->gc_boundary = 0;
+		shared_state->text_table_size = store_size;
 		shared_state->stats.dealloc = 0;
+		shared_state->stats.collisions = 0;
 		shared_state->stats.stats_reset = GetCurrentTimestamp();
+		shared_state->num_entries = 0;
+#if PG_VERSION_NUM >= 150000
+		shared_state->dsh_loaded = false;
+		if (ENTRIES_IN_DSA())
+		{
+			shared_state->dsa_tranche = LWLockNewTrancheId();
+			shared_state->dsh_tranche = LWLockNewTrancheId();
+		}
+#endif
 	}
 
-	/* Be sure everyone agrees on the hash table entry size */
-	plan_size = shared_state->plan_size;
-
 	memset(&info, 0, sizeof(info));
 	info.keysize = sizeof(pgspHashKey);
 	info.entrysize = sizeof(pgspEntry);
 	if (plan_storage == PLAN_STORAGE_SHMEM)
 		info.entrysize += max_plan_len;
-	hash_table = ShmemInitHash("pg_store_plans hash",
-							  store_size, store_size,
-							  &info, HASH_ELEM |
-							  HASH_BLOBS);
+
+#if PG_VERSION_NUM >= 150000
+	if (ENTRIES_IN_DSA())
+	{
+		bool		found_dsa;
+
+		dsa_place = ShmemInitStruct("pg_store_plans dsa",
+									PGSP_DSA_INITIAL_SIZE, &found_dsa);
+		LWLockRegisterTranche(shared_state->dsa_tranche,
+							  "pg_store_plans dsa");
+		LWLockRegisterTranche(shared_state->dsh_tranche,
+							  "pg_store_plans dshash");
+		if (!found_dsa)
+			dsh_create();
+	}
+#endif
+
+	for (i = 0 ; i < num_partitions && !dynamic_table ; i++)
+	{
+		char		name[64];
+
+		snprintf(name, sizeof(name), "pg_store_plans hash %d", i);
+		hash_tables[i] = ShmemInitHash(name,
+									   partition_size, partition_size,
+									   &info, HASH_ELEM |
+									   HASH_BLOBS);
+	}
+
+	if (plan_storage == PLAN_STORAGE_FILE)
+	{
+		HASHCTL		tinfo;
+
+		memset(&tinfo, 0, sizeof(tinfo));
+		tinfo.keysize = sizeof(pgspTextKey);
+		tinfo.entrysize = sizeof(pgspPlanText);
+		text_table = ShmemInitHash("pg_store_plans plan texts",
+								   store_size, store_size,
+								   &tinfo, HASH_ELEM | HASH_BLOBS);
+	}
+
+	if (PLAN_WRITER_ENABLED())
+	{
+		bool		found_queue;
+
+		plan_queue = ShmemInitStruct("pg_store_plans plan queue",
+									 (Size) writer_queue_size * 1024,
+									 &found_queue);
+	}
 
 	LWLockRelease(AddinShmemInitLock);
 
@@ -694,28 +1525,62 @@ pgsp_shmem_startup(void)
 	 * processes running when this code is reached.
 	 */
 
-	/* Unlink query text file possibly left over from crash */
+	/* Unlink query text files possibly left over from crash */
 	unlink(PGSP_TEXT_FILE);
+	unlink(PGSP_GC_TEXT_FILE);
 
 	if (plan_storage == PLAN_STORAGE_FILE)
 	{
 		/* Allocate new query text temp file */
 		pfile = AllocateFile(PGSP_TEXT_FILE, PG_BINARY_W);
 		if (pfile == NULL)
-			goto write_error;
+		{
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not write file \"%s\": %m",
+							PGSP_TEXT_FILE)));
+			/* If possible, throw away the dump file; ignore any error */
+			unlink(PGSP_DUMP_FILE);
+			return;
+		}
 	}
 
 	/*
 	 * If we were told not to load old statistics, we're done.  (Note we do
 	 * not try to unlink any old dump file in this case.  This seems a bit
 	 * questionable but it's the historical behavior.)
+	 *
+	 * The dynamic hash table is loaded later by plan writer.
 	 */
-	if (!dump_on_shutdown)
-	{
-		if (pfile)
-			FreeFile(pfile);
-		return;
-	}
+	if (dump_on_shutdown && !ENTRIES_IN_DSA())
+		entries_load(pfile);
+
+	if (pfile)
+		FreeFile(pfile);
+}
+
+/*
+ * Load the statistics saved in the dump file.
+ *
+ * Plan texts are appended to pfile if given, or stored by ptext_store() or
+ * ptext_dsa_store() otherwise.  In the former case no other process must be
+ * running, and in the latter case the caller must hold exclusive locks on all
+ * partitions.
+ */
+static void
+entries_load(FILE *pfile)
+{
+	FILE	   *file = NULL;
+	uint32		header;
+	int32		num;
+	int32		pgver;
+	int32		i;
+	int			plan_size = shared_state->plan_size;
+	int			buffer_size;
+	char	   *buffer = NULL;
+	MemoryContext textcxt = NULL;
+	HTAB	   *texts;
+	HASHCTL		ctl;
 
 	/*
 	 * Attempt to load old statistics from the dump file.
@@ -728,8 +1593,6 @@ pgsp_shmem_startup(void)
 			goto read_error;
 
 		/* No existing persisted stats file, so we're done */
-		if (pfile)
-			FreeFile(pfile);
 		return;
 	}
 
@@ -745,11 +1608,26 @@ pgsp_shmem_startup(void)
 		pgver != PGSP_PG_MAJOR_VERSION)
 		goto data_error;
 
+	/* Shared plan texts read so far, which later entries may refer to */
+	textcxt = AllocSetContextCreate(CurrentMemoryContext,
+									"pg_store_plans dumped texts",
+									ALLOCSET_DEFAULT_SIZES);
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(pgspTextKey);
+	ctl.entrysize = sizeof(pgspDumpedText);
+	ctl.hcxt = textcxt;
+	texts = hash_create("pg_store_plans dumped texts", 256, &ctl,
+						HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
 	for (i = 0; i < num; i++)
 	{
 		pgspEntry	temp;
 		pgspEntry  *entry;
+		pgspTextKey	tkey;
+		pgspDumpedText *text;
 		Size		plan_offset = 0;
+		bool		found;
+		bool		shared;
 
 		if (fread(&temp, sizeof(pgspEntry), 1, file) != 1)
 			goto read_error;
@@ -765,8 +1643,32 @@ pgsp_shmem_startup(void)
 			buffer_size = temp.plan_len + 1;
 		}
 
-		if (fread(buffer, 1, temp.plan_len + 1, file) != temp.plan_len + 1)
-			goto read_error;
+		ptext_make_key(&tkey, &temp.key, temp.encoding);
+
+		if (temp.plan_offset == DUMP_TEXT_REFERENCE)
+		{
+			/* The plan text has been read with a previous entry */
+			text = (pgspDumpedText *) hash_search(texts, &tkey, HASH_FIND,
+												  NULL);
+			if (text == NULL || text->plan_len != temp.plan_len)
+				goto data_error;
+			memcpy(buffer, text->plan, temp.plan_len + 1);
+		}
+		else
+		{
+			if (fread(buffer, 1, temp.plan_len + 1, file) !=
+				temp.plan_len + 1)
+				goto read_error;
+
+			if (temp.plan_offset == DUMP_TEXT_SHARED)
+			{
+				text = (pgspDumpedText *) hash_search(texts, &tkey,
+													  HASH_ENTER, &found);
+				text->plan = MemoryContextAlloc(textcxt, temp.plan_len + 1);
+				memcpy(text->plan, buffer, temp.plan_len + 1);
+				text->plan_len = temp.plan_len;
+			}
+		}
 
 		/* Skip loading "sticky" entries */
 		if (temp.counters.calls == 0)
@@ -774,14 +1676,31 @@ pgsp_shmem_startup(void)
 
 		/* Clip to available length if needed */
 		if (temp.plan_len >= plan_size)
-			temp.plan_len = pg_encoding_mbcliplen(temp.encoding,
-												   buffer,
-												   temp.plan_len,
-												   plan_size - 1);
+		{
+			char	   *raw = plan_decompress(buffer, temp.plan_len);
+			char	   *stored;
+
+			if (raw == NULL)
+				goto data_error;
+
+			temp.plan_len = strlen(raw);
+			stored = plan_compress(raw, &temp.plan_len, temp.encoding);
+			if (stored != buffer)
+				memcpy(buffer, stored, temp.plan_len);
+
+			if (stored != raw)
+				pfree(stored);
+			if (raw != buffer)
+				pfree(raw);
+		}
 
 		buffer[temp.plan_len] = '\0';
 
-		if (plan_storage == PLAN_STORAGE_FILE)
+		/* The plan text may have been stored for another entry */
+		shared = (plan_storage == PLAN_STORAGE_FILE &&
+				  ptext_lookup(&temp.key, &plan_offset, &temp.plan_len));
+
+		if (!shared && plan_storage == PLAN_STORAGE_FILE && pfile)
 		{
 			/* Store the plan text */
 			plan_offset = shared_state->extent;
@@ -790,23 +1709,35 @@ pgsp_shmem_startup(void)
 				goto write_error;
 			shared_state->extent += temp.plan_len + 1;
 		}
+		else if (!shared && plan_storage == PLAN_STORAGE_FILE)
+		{
+			/* ptext_store() has already complained */
+			if (!ptext_store(buffer, temp.plan_len, &plan_offset, NULL))
+				goto fail;
+		}
+		else if (plan_storage == PLAN_STORAGE_DSA)
+		{
+			/* ptext_dsa_store() has already complained */
+			if (!ptext_dsa_store(buffer, temp.plan_len, &plan_offset))
+				goto fail;
+		}
 
 		/* make the hashtable entry (discards old entries if too many) */
-		entry = entry_alloc(&temp.key, plan_offset, temp.plan_len, false);
+		entry = entry_alloc(&temp.key, plan_offset, temp.plan_len,
+							temp.plan_check, false);
 
 		if (plan_storage == PLAN_STORAGE_SHMEM)
 			memcpy(SHMEM_PLAN_PTR(entry), buffer, temp.plan_len + 1);
 
 		/* copy in the actual stats */
 		entry->counters = temp.counters;
+		atomic_counters_init(&entry->acounters, &temp.counters);
 	}
 
 	pfree(buffer);
+	MemoryContextDelete(textcxt);
 	FreeFile(file);
 
-	if (pfile)
-		FreeFile(pfile);
-
 	/*
 	 * Remove the file so it's not included in backups/replication slaves,
 	 * etc. A new file will be written on next shutdown.
@@ -835,10 +1766,10 @@ write_error:
 fail:
 	if (buffer)
 		pfree(buffer);
+	if (textcxt)
+		MemoryContextDelete(textcxt);
 	if (file)
 		FreeFile(file);
-	if (pfile)
-		FreeFile(pfile);
 	/* If possible, throw away the bogus file; ignore any error */
 	unlink(PGSP_DUMP_FILE);
 
@@ -857,25 +1788,51 @@ fail:
 static void
 pgsp_shmem_shutdown(int code, Datum arg)
 {
-	FILE	   *file;
-	char	   *pbuffer = NULL;
-	Size		pbuffer_size = 0;
-	HASH_SEQ_STATUS hash_seq;
-	int32		num_entries;
-	pgspEntry  *entry;
-
 	/* Don't try to dump during a crash. */
 	if (code)
 		return;
 
 	/* Safety check ... shouldn't get here unless shmem is set up. */
-	if (!shared_state || !hash_table)
+	if (!TABLE_READY())
+		return;
+
+	/* Entries in DSA have been saved by plan writer */
+	if (ENTRIES_IN_DSA())
 		return;
 
 	/* Don't dump if told not to. */
 	if (!dump_on_shutdown)
 		return;
 
+	/* Plan writer has already gone, write out the rest of the queue */
+	if (plan_queue)
+		ptext_write_queue(false);
+
+	/* Unlink query-texts file; it's not needed while shutdown */
+	if (entries_dump())
+		unlink(PGSP_TEXT_FILE);
+}
+
+/*
+ * Write out all entries into the dump file.  Returns false on failure.
+ *
+ * The caller must prevent the entries from being removed and queued plan
+ * texts must have been written out.
+ */
+static bool
+entries_dump(void)
+{
+	FILE	   *file;
+	char	   *pbuffer = NULL;
+	Size		pbuffer_size = 0;
+	pgspEntryScan scan;
+	int32		num_entries;
+	pgspEntry  *entry;
+	pgspEntry	temp;
+	HTAB	   *texts = NULL;
+	HASHCTL		ctl;
+	int			i;
+
 	file = AllocateFile(PGSP_DUMP_FILE ".tmp", PG_BINARY_W);
 	if (file == NULL)
 		goto error;
@@ -884,41 +1841,83 @@ pgsp_shmem_shutdown(int code, Datum arg)
 		goto error;
 	if (fwrite(&PGSP_PG_MAJOR_VERSION, sizeof(uint32), 1, file) != 1)
 		goto error;
-	num_entries = hash_get_num_entries(hash_table);
+	num_entries = 0;
+	for (i = 0 ; i < num_partitions ; i++)
+		num_entries += partition_num_entries(i);
 	if (fwrite(&num_entries, sizeof(int32), 1, file) != 1)
 		goto error;
 
 	if (plan_storage == PLAN_STORAGE_FILE)
 	{
-		pbuffer = ptext_load_file(&pbuffer_size);
-		if (pbuffer == NULL)
+		/* An empty file cannot be mapped, but then there's nothing to read */
+		pbuffer = ptext_map_file(&pbuffer_size);
+		if (pbuffer == NULL && shared_state->extent > 0)
 			goto error;
+
+		/* Shared plan texts already written out */
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(pgspTextKey);
+		ctl.entrysize = sizeof(pgspDumpedText);
+		texts = hash_create("pg_store_plans dumped texts", 256, &ctl,
+							HASH_ELEM | HASH_BLOBS);
 	}
 
-	hash_seq_init(&hash_seq, hash_table);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	for (i = 0 ; i < num_partitions ; i++)
 	{
-		int			len = entry->plan_len;
-		char	   *pstr;
-
-		if (plan_storage == PLAN_STORAGE_FILE)
-			pstr = ptext_fetch(entry->plan_offset, len,
-							   pbuffer, pbuffer_size);
-		else
-			pstr = SHMEM_PLAN_PTR(entry);
-
-		if (pstr == NULL)
-			continue;			/* Ignore any entries with bogus texts */
-
-		if (fwrite(entry, sizeof(pgspEntry), 1, file) != 1 ||
-			fwrite(pstr, 1, len + 1, file) != len + 1)
+		entry_scan_init(&scan, i, false);
+		while ((entry = entry_scan_next(&scan)) != NULL)
 		{
-			/* note: we assume hash_seq_term won't change errno */
-			hash_seq_term(&hash_seq);
-			goto error;
+			int			len = entry->plan_len;
+			char	   *pstr;
+			pgspDumpedText *text = NULL;
+			pgspTextKey	tkey;
+			bool		found = false;
+
+			pstr = entry_plan_text(entry, pbuffer, pbuffer_size);
+			if (pstr == NULL)
+				continue;			/* Ignore any entries with bogus texts */
+
+			/* Store the additive counters in counters */
+			memcpy(&temp, entry, sizeof(pgspEntry));
+			atomic_counters_read(&entry->acounters, &temp.counters);
+
+			/* A shared plan text is written only with its first entry */
+			temp.plan_offset = DUMP_TEXT_PRIVATE;
+			temp.text_shared = false;
+			if (entry->text_shared)
+			{
+				ptext_make_key(&tkey, &entry->key, entry->encoding);
+				text = (pgspDumpedText *) hash_search(texts, &tkey,
+													  HASH_ENTER, &found);
+				if (found)
+				{
+					temp.plan_offset = DUMP_TEXT_REFERENCE;
+					temp.plan_len = text->plan_len;
+				}
+				else
+				{
+					temp.plan_offset = DUMP_TEXT_SHARED;
+					text->plan_len = len;
+				}
+			}
+
+			if (fwrite(&temp, sizeof(pgspEntry), 1, file) != 1 ||
+				(!found && fwrite(pstr, 1, len + 1, file) != len + 1))
+			{
+				/* note: we assume entry_scan_term won't change errno */
+				entry_scan_term(&scan);
+				goto error;
+			}
 		}
 	}
 
+	if (pbuffer)
+		ptext_unmap_file(pbuffer, pbuffer_size);
+	pbuffer = NULL;
+	if (texts)
+		hash_destroy(texts);
+	texts = NULL;
+
 	if (FreeFile(file))
 	{
 		file = NULL;
@@ -934,154 +1933,436 @@ pgsp_shmem_shutdown(int code, Datum arg)
 				 errmsg("could not rename pg_store_plans file \"%s\": %m",
 						PGSP_DUMP_FILE ".tmp")));
 
-	/* Unlink query-texts file; it's not needed while shutdown */
-	unlink(PGSP_TEXT_FILE);
-
-	return;
+	return true;
 
 error:
 	ereport(LOG,
 			(errcode_for_file_access(),
 			 errmsg("could not write pg_store_plans file \"%s\": %m",
 					PGSP_DUMP_FILE ".tmp")));
+	if (pbuffer)
+		ptext_unmap_file(pbuffer, pbuffer_size);
+	if (texts)
+		hash_destroy(texts);
 	if (file)
 		FreeFile(file);
 	unlink(PGSP_DUMP_FILE ".tmp");
+
+	return false;
 }
 
 
 /*
- * ExecutorStart hook: start up tracking if needed
+ * pgsp_filter: check the statement against the tracking filters
+ *
+ * Databases and roles are compared by name, which needs catalog access, so
+ * the result is remembered until the user or the lists change.  Outside a
+ * transaction the last result is used.
  */
-static void
-pgsp_ExecutorStart(QueryDesc *queryDesc, int eflags)
+static bool
+pgsp_filter(queryid_t queryid)
 {
-	if (!IsParallelWorker() && log_analyze &&
-		(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+	Oid			userid = GetUserId();
+
+	if ((filter_checked_generation != filter_generation ||
+		 filter_checked_userid != userid) && IsTransactionState())
 	{
-		queryDesc->instrument_options |=
-			(log_timing ? INSTRUMENT_TIMER : 0)|
-			(log_timing ? 0: INSTRUMENT_ROWS)|
-			(log_buffers ? INSTRUMENT_BUFFERS : 0);
-	}
+		bool		passed = true;
 
-	if (prev_ExecutorStart)
-		prev_ExecutorStart(queryDesc, eflags);
-	else
-		standard_ExecutorStart(queryDesc, eflags);
+		if (track_databases[0] || ignore_databases[0])
+		{
+			char	   *dbname = get_database_name(MyDatabaseId);
 
-	/*
-	 * Set up to track total elapsed time in ExecutorRun. Allocate in per-query
-	 * context so as to be free at ExecutorEnd.
-	 */
-	if (!IsParallelWorker() && queryDesc->totaltime == NULL &&
-			pgsp_enabled(queryDesc->plannedstmt->queryId))
-	{
-		MemoryContext oldcxt;
+			if (dbname &&
+				((track_databases[0] &&
+				  !name_in_list(dbname, track_databases)) ||
+				 name_in_list(dbname, ignore_databases)))
+				passed = false;
+		}
 
-		oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
-		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL
-#if PG_VERSION_NUM >= 140000
-										  , false
-#endif
-										 );
-		MemoryContextSwitchTo(oldcxt);
+		if (passed && (track_roles[0] || ignore_roles[0]))
+		{
+			char	   *rolename = GetUserNameFromId(userid, true);
+
+			if (rolename &&
+				((track_roles[0] && !name_in_list(rolename, track_roles)) ||
+				 name_in_list(rolename, ignore_roles)))
+				passed = false;
+		}
+
+		filter_passed = passed;
+		filter_checked_generation = filter_generation;
+		filter_checked_userid = userid;
 	}
 
+	if (!filter_passed)
+		return false;
+
+	if (track_queryid_list &&
+		!queryid_in_list((int64) queryid, track_queryid_list))
+		return false;
+
+	if (ignore_queryid_list &&
+		queryid_in_list((int64) queryid, ignore_queryid_list))
+		return false;
+
+	return true;
 }
 
 /*
- * ExecutorRun hook: all we need do is track nesting depth
+ * Returns true if name is found in the comma-separated list of names.
  */
-static void
-pgsp_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
-				 bool execute_once)
+static bool
+name_in_list(const char *name, const char *list)
 {
-	nested_level++;
-	PG_TRY();
-	{
-		if (prev_ExecutorRun)
-			prev_ExecutorRun(queryDesc, direction, count, execute_once);
-		else
-			standard_ExecutorRun(queryDesc, direction, count, execute_once);
-		nested_level--;
-	}
-	PG_CATCH();
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *lc;
+	bool		found = false;
+
+	if (list[0] == '\0')
+		return false;
+
+	rawstring = pstrdup(list);
+
+	/* The syntax has been checked by check_name_list() */
+	if (SplitIdentifierString(rawstring, ',', &elemlist))
 	{
-		nested_level--;
-		PG_RE_THROW();
+		foreach(lc, elemlist)
+		{
+			if (strcmp(name, (char *) lfirst(lc)) == 0)
+			{
+				found = true;
+				break;
+			}
+		}
 	}
-	PG_END_TRY();
+
+	list_free(elemlist);
+	pfree(rawstring);
+
+	return found;
+}
+
+static int
+queryid_cmp(const void *a, const void *b)
+{
+	int64		ia = *(const int64 *) a;
+	int64		ib = *(const int64 *) b;
+
+	return (ia > ib) - (ia < ib);
 }
 
 /*
- * ExecutorFinish hook: all we need do is track nesting depth
+ * Returns true if queryid is in the list.
  */
-static void
-pgsp_ExecutorFinish(QueryDesc *queryDesc)
+static bool
+queryid_in_list(int64 queryid, pgspQueryIdList *list)
 {
-	nested_level++;
-	PG_TRY();
-	{
-		if (prev_ExecutorFinish)
-			prev_ExecutorFinish(queryDesc);
-		else
-			standard_ExecutorFinish(queryDesc);
-		nested_level--;
-	}
-	PG_CATCH();
-	{
-		nested_level--;
-		PG_RE_THROW();
-	}
-	PG_END_TRY();
+	return bsearch(&queryid, list->ids, list->nids, sizeof(int64),
+				   queryid_cmp) != NULL;
 }
 
 /*
- * ExecutorEnd hook: store results if needed
+ * GUC check hook for lists of database or role names
  */
-static void
-pgsp_ExecutorEnd(QueryDesc *queryDesc)
+static bool
+check_name_list(char **newval, void **extra, GucSource source)
 {
-	if (!IsParallelWorker() && queryDesc->totaltime)
-	{
-		/*
-		 * Make sure stats accumulation is done.  (Note: it's okay if several
-		 * levels of hook all do this.)
-		 */
-		InstrEndLoop(queryDesc->totaltime);
-
-		if (pgsp_enabled(queryDesc->plannedstmt->queryId) &&
-			queryDesc->totaltime->total &&
-			queryDesc->totaltime->total >=
-			(double)min_duration / 1000.0)
-		{
-			queryid_t	  queryid;
-			ExplainState *es;
-			StringInfo	  es_str;
+	char	   *rawstring;
+	List	   *elemlist;
+	bool		ok;
 
-			es = NewExplainState();
-			es_str = es->str;
+	rawstring = pstrdup(*newval);
+	ok = SplitIdentifierString(rawstring, ',', &elemlist);
+	if (!ok)
+		GUC_check_errdetail("List syntax is invalid.");
 
-			es->analyze = queryDesc->instrument_options;
-			es->verbose = log_verbose;
-			es->buffers = (es->analyze && log_buffers);
-			es->timing = (es->analyze && log_timing);
-			es->format = EXPLAIN_FORMAT_JSON;
+	list_free(elemlist);
+	pfree(rawstring);
 
-			ExplainBeginOutput(es);
-			ExplainPrintPlan(es, queryDesc);
-			if (log_triggers)
-				pgspExplainTriggers(es, queryDesc);
-			ExplainEndOutput(es);
+	return ok;
+}
 
-			/* Remove last line break */
-			if (es_str->len > 0 && es_str->data[es_str->len - 1] == '\n')
-				es_str->data[--es_str->len] = '\0';
+/*
+ * GUC assign hook for lists of database or role names
+ */
+static void
+assign_name_list(const char *newval, void *extra)
+{
+	/* Have the filter result recalculated */
+	filter_generation++;
+}
+
+/*
+ * GUC check hook for lists of query ids
+ *
+ * The list is parsed into a sorted array passed to the assign hook as the
+ * extra, which is NULL for an empty list.
+ */
+static bool
+check_queryid_list(char **newval, void **extra, GucSource source)
+{
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *lc;
+	pgspQueryIdList *idlist;
+	int			n = 0;
+
+	rawstring = pstrdup(*newval);
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		list_free(elemlist);
+		pfree(rawstring);
+		return false;
+	}
+
+	if (elemlist == NIL)
+	{
+		pfree(rawstring);
+		*extra = NULL;
+		return true;
+	}
+
+	idlist = (pgspQueryIdList *)
+		malloc(offsetof(pgspQueryIdList, ids) +
+			   sizeof(int64) * list_length(elemlist));
+	if (!idlist)
+	{
+		list_free(elemlist);
+		pfree(rawstring);
+		return false;
+	}
+
+	foreach(lc, elemlist)
+	{
+		char	   *str = (char *) lfirst(lc);
+		char	   *endptr;
+
+		errno = 0;
+		idlist->ids[n++] = strtoi64(str, &endptr, 10);
+		if (errno != 0 || *endptr != '\0' || endptr == str)
+		{
+			GUC_check_errdetail("Invalid query id: \"%s\".", str);
+			free(idlist);
+			list_free(elemlist);
+			pfree(rawstring);
+			return false;
+		}
+	}
+	idlist->nids = n;
+	qsort(idlist->ids, n, sizeof(int64), queryid_cmp);
+
+	list_free(elemlist);
+	pfree(rawstring);
+
+	*extra = idlist;
+	return true;
+}
+
+static void
+assign_track_queryids(const char *newval, void *extra)
+{
+	track_queryid_list = (pgspQueryIdList *) extra;
+}
+
+static void
+assign_ignore_queryids(const char *newval, void *extra)
+{
+	ignore_queryid_list = (pgspQueryIdList *) extra;
+}
+
+/*
+ * GUC check hook for patterns of relation names to mask
+ *
+ * The list is converted into the form of pgsp_relname_patterns passed to the
+ * assign hook as the extra, which is NULL for an empty list.
+ */
+static bool
+check_relname_patterns(char **newval, void **extra, GucSource source)
+{
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *lc;
+	char	   *patterns;
+	Size		len = 1;
+	char	   *p;
+
+	rawstring = pstrdup(*newval);
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		list_free(elemlist);
+		pfree(rawstring);
+		return false;
+	}
+
+	if (elemlist == NIL)
+	{
+		pfree(rawstring);
+		*extra = NULL;
+		return true;
+	}
+
+	foreach(lc, elemlist)
+		len += strlen((char *) lfirst(lc)) + 1;
+
+	patterns = (char *) malloc(len);
+	if (!patterns)
+	{
+		list_free(elemlist);
+		pfree(rawstring);
+		return false;
+	}
+
+	p = patterns;
+	foreach(lc, elemlist)
+	{
+		char	   *pattern = (char *) lfirst(lc);
+
+		/* An empty pattern would terminate the sequence */
+		if (pattern[0] == '\0')
+			continue;
+		strcpy(p, pattern);
+		p += strlen(pattern) + 1;
+	}
+	*p = '\0';
+
+	list_free(elemlist);
+	pfree(rawstring);
+
+	*extra = patterns;
+	return true;
+}
+
+static void
+assign_relname_patterns(const char *newval, void *extra)
+{
+	pgsp_relname_patterns = (const char *) extra;
+
+	/* Plan ids cached with the old patterns are no longer valid */
+	relname_patterns_generation++;
+}
+
+/*
+ * ExecutorStart hook: start up tracking if needed
+ */
+static void
+pgsp_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	if (!IsParallelWorker() && log_analyze &&
+		(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0 &&
+		pgsp_enabled(queryDesc->plannedstmt->queryId) &&
+		(!ANALYZE_SAMPLING() ||
+		 pgsp_analyze_sample((uint64) queryDesc->plannedstmt->queryId,
+							 analyze_sample_rate, analyze_min_interval,
+							 planid_cache_size)))
+	{
+		queryDesc->instrument_options |=
+			(log_timing ? INSTRUMENT_TIMER : 0)|
+			(log_timing ? 0: INSTRUMENT_ROWS)|
+			(log_buffers ? INSTRUMENT_BUFFERS : 0);
+	}
+
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	/*
+	 * Set up to track total elapsed time in ExecutorRun. Allocate in per-query
+	 * context so as to be free at ExecutorEnd.
+	 */
+	if (!IsParallelWorker() && queryDesc->totaltime == NULL &&
+			pgsp_enabled(queryDesc->plannedstmt->queryId))
+	{
+		MemoryContext oldcxt;
+
+		oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+		queryDesc->totaltime =
+			InstrAlloc(1, INSTRUMENT_TIMER |
+					   (instrument_level >= INSTRUMENT_LEVEL_BUFFERS ?
+						INSTRUMENT_BUFFERS : 0)
+#if PG_VERSION_NUM >= 140000
+					   , false
+#endif
+				);
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+}
+
+/*
+ * ExecutorRun hook: all we need do is track nesting depth
+ */
+static void
+pgsp_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+				 bool execute_once)
+{
+	nested_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+		nested_level--;
+	}
+	PG_CATCH();
+	{
+		nested_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * ExecutorFinish hook: all we need do is track nesting depth
+ */
+static void
+pgsp_ExecutorFinish(QueryDesc *queryDesc)
+{
+	nested_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorFinish)
+			prev_ExecutorFinish(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+		nested_level--;
+	}
+	PG_CATCH();
+	{
+		nested_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
 
-			/* JSON outmost braces. */
-			es_str->data[0] = '{';
-			es_str->data[es_str->len - 1] = '}';
+/*
+ * ExecutorEnd hook: store results if needed
+ */
+static void
+pgsp_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (!IsParallelWorker() && queryDesc->totaltime)
+	{
+		bool		fast;
+
+		/*
+		 * Make sure stats accumulation is done.  (Note: it's okay if several
+		 * levels of hook all do this.)
+		 */
+		InstrEndLoop(queryDesc->totaltime);
+
+		fast = (queryDesc->totaltime->total < (double)min_duration / 1000.0);
+
+		if (pgsp_enabled(queryDesc->plannedstmt->queryId) &&
+			queryDesc->totaltime->total &&
+			(!fast || count_fast))
+		{
+			queryid_t	  queryid;
 
 			queryid = queryDesc->plannedstmt->queryId;
 #if PG_VERSION_NUM < 140000
@@ -1099,12 +2380,13 @@ pgsp_ExecutorEnd(QueryDesc *queryDesc)
 			Assert(queryid != PGSP_NO_QUERYID);
 #endif
 
-			pgsp_store(es_str->data,
-						queryid,
-						queryDesc->totaltime->total * 1000.0,	/* convert to msec */
-						queryDesc->estate->es_processed,
-						&queryDesc->totaltime->bufusage);
-			pfree(es_str->data);
+			pgsp_capture(queryDesc,
+						 queryid,
+						 queryDesc->totaltime->total * 1000.0,	/* convert to msec */
+						 queryDesc->estate->es_processed,
+						 queryDesc->totaltime->need_bufusage ?
+						 &queryDesc->totaltime->bufusage : NULL,
+						 fast);
 		}
 	}
 
@@ -1186,10 +2468,8 @@ hash_query(const char* query)
 {
 	uint32 queryid;
 
-	char *normquery = pstrdup(query);
-	normalize_expr(normquery, false);
+	const char *normquery = normalize_expr_cached(query, false);
 	queryid = hash_any((const unsigned char*)normquery, strlen(normquery));
-	pfree(normquery);
 
 	/* If we are unlucky enough to get a hash of zero, use 1 instead */
 	if (queryid == 0)
@@ -1199,69 +2479,349 @@ hash_query(const char* query)
 }
 
 
+/*
+ * pgsp_explain_plan: explain the plan of the query in JSON format
+ *
+ * The result is palloc'ed in the current memory context.
+ */
+static char *
+pgsp_explain_plan(QueryDesc *queryDesc)
+{
+	ExplainState *es;
+	StringInfo	  es_str;
+
+	es = NewExplainState();
+	es_str = es->str;
+
+	/* Plans of a backend tend to be similar in size */
+	if (last_explain_len >= es_str->maxlen)
+		enlargeStringInfo(es_str, last_explain_len);
+
+	es->analyze = queryDesc->instrument_options;
+	es->verbose = log_verbose;
+	es->buffers = (es->analyze && log_buffers);
+	es->timing = (es->analyze && log_timing);
+	es->format = EXPLAIN_FORMAT_JSON;
+
+	ExplainBeginOutput(es);
+	ExplainPrintPlan(es, queryDesc);
+	if (log_triggers)
+		pgspExplainTriggers(es, queryDesc);
+	ExplainEndOutput(es);
+
+	/* Remove last line break */
+	if (es_str->len > 0 && es_str->data[es_str->len - 1] == '\n')
+		es_str->data[--es_str->len] = '\0';
+
+	/* JSON outmost braces. */
+	es_str->data[0] = '{';
+	es_str->data[es_str->len - 1] = '}';
+
+	last_explain_len = es_str->len;
+
+	return es_str->data;
+}
+
+/*
+ * Call pgsp_store() in the capture memory context.
+ *
+ * Everything allocated while explaining, parsing and storing the plan is
+ * thrown away at once by resetting the context, rather than being left in
+ * the caller's context, which may live long, for example, in a loop of a
+ * PL/pgSQL function.  The context keeps a block to be reused by following
+ * captures.
+ */
+static void
+pgsp_capture(QueryDesc *queryDesc, queryid_t queryId,
+			 double total_time, uint64 rows,
+			 const BufferUsage *bufusage, bool fast)
+{
+	MemoryContext oldcontext;
+
+	/* Shouldn't happen, but don't reset the context in use */
+	if (capturing)
+	{
+		pgsp_store(queryDesc, queryId, total_time, rows, bufusage, fast);
+		return;
+	}
+
+	if (capture_context == NULL)
+		capture_context = AllocSetContextCreate(TopMemoryContext,
+												"pg_store_plans capture",
+												ALLOCSET_DEFAULT_MINSIZE,
+												PGSP_CAPTURE_BLOCK_SIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+
+	oldcontext = MemoryContextSwitchTo(capture_context);
+	capturing = true;
+
+	PG_TRY();
+	{
+		pgsp_store(queryDesc, queryId, total_time, rows, bufusage, fast);
+		capturing = false;
+	}
+	PG_CATCH();
+	{
+		capturing = false;
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(capture_context);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(capture_context);
+}
+
 /*
  * Store some statistics for a plan.
  *
  * Table entry is keyed with userid.dbid.queryId.planId. planId is the hash
- * value of the given plan, which is calculated in ths function.
+ * value of the plan of the given query, which is calculated in ths function.
+ *
+ * The plan id is calculated first and the plan text is shortened only when a
+ * new entry is to be created. When plan ids are calculated from plan trees or
+ * found in the plan id cache, the plan is not even explained otherwise. The
+ * same goes for executions not sampled by pg_store_plans.sample_rate, which
+ * are accounted to the last verified plan of the query.
+ *
+ * Executions selected by analyze sampling replace the plan text of existing
+ * entries so that it shows recent actual rows and times.
+ *
+ * Fast executions, those shorter than pg_store_plans.min_duration, are
+ * accounted to the last verified plan of the query, and only a fraction of
+ * them are verified unless plan id sampling is enabled. Thus a changed plan
+ * of a query executed only fast is noticed within a few dozen executions
+ * rather than at once. The plan is explained for them also when the plan of
+ * the query is not known yet or its entry is missing.
  */
 static void
-pgsp_store(char *plan, queryid_t queryId,
+pgsp_store(QueryDesc *queryDesc, queryid_t queryId,
 		   double total_time, uint64 rows,
-		   const BufferUsage *bufusage)
+		   const BufferUsage *bufusage, bool fast)
 {
 	pgspHashKey key;
 	pgspEntry  *entry;
-	char	   *norm_query = NULL;
+	char	   *plan = NULL;
 	int 		plan_len;
-	char	   *normalized_plan = NULL;
 	char	   *shorten_plan = NULL;
-	volatile pgspEntry *e;
+	char	   *stored_plan;
 	Size		plan_offset = 0;
 	bool		do_gc = false;
-
-	Assert(plan != NULL && queryId != PGSP_NO_QUERYID);
+	bool		planid_known = false;
+	bool		planid_sampled = false;
+	bool		updated = false;
+	bool		use_cache;
+	bool		refresh_plan;
+	bool		track_last_plan;
+	double		verify_rate;
+	Counters	delta;
+	pgspPendingEntry *pending;
+	LWLock	   *lock;
+	int			planid_variant;
+	int			planid_flags;
+	int			part;
+	uint32		plan_check = 0;
+
+	Assert(queryId != PGSP_NO_QUERYID);
 
 	/* Safety check... */
-	if (!shared_state || !hash_table)
+	if (!TABLE_READY())
 		return;
 
 	/* Set up key for hashtable search */
-	key.userid = GetUserId();
-	key.dbid = MyDatabaseId;
+	memset(&key, 0, sizeof(pgspHashKey));
+	/* Shared entries have zero in the omitted key columns */
+	key.userid = ((aggregate & AGGREGATE_USERS) ? InvalidOid : GetUserId());
+	key.dbid = ((aggregate & AGGREGATE_DATABASES) ? InvalidOid : MyDatabaseId);
 	key.queryid = queryId;
 
-	normalized_plan = pgsp_json_normalize(plan);
+	counters_set(&delta, total_time, rows, bufusage);
+
+	/* Forget local counters after they are disabled */
+	if (flush_interval <= 0 && pending_table &&
+		hash_get_num_entries(pending_table) > 0)
+		pending_flush(true);
+
+	/*
+	 * Plan ids may be calculated differently by the settings below, so cache
+	 * them separately.
+	 */
+	planid_flags = (fold_appends ? PGSP_FOLD_APPENDS : 0) |
+		(mask_temp_schemas ? PGSP_MASK_TEMP_SCHEMAS : 0) |
+		(pgsp_relname_patterns ? PGSP_MASK_RELNAMES : 0);
+	planid_variant = plan_fingerprint | (log_verbose ? 0x10 : 0) |
+		(planid_flags << 8) | ((relname_patterns_generation & 0x7fff) << 16);
+
+	/*
+	 * JSON-based plan ids may vary between executions of the same plan when
+	 * fired triggers are included, so don't cache them in that case.
+	 */
+	use_cache = (plan_fingerprint == PLAN_FINGERPRINT_TREE ||
+				 !(log_triggers && queryDesc->instrument_options));
+
+	/* The plan text is refreshed only with the actual plan of the query */
+	refresh_plan = (!fast && log_analyze && ANALYZE_SAMPLING() &&
+					queryDesc->instrument_options != 0);
+
+	/*
+	 * The last verified plan of each query is remembered for plan id sampling
+	 * and for fast executions.  The latter are still verified now and then
+	 * when not sampled otherwise, since the plan may have changed by
+	 * replanning, which also misses the plan id cache, or the plan id cache
+	 * may not be of any help as with the simple query protocol.
+	 */
+	track_last_plan = (sample_rate < 1.0 || sample_adaptive || count_fast);
+	verify_rate = sample_rate;
+	if (fast && sample_rate >= 1.0 && !sample_adaptive)
+		verify_rate = FAST_VERIFY_RATE;
+
+	if (use_cache &&
+		pgsp_planid_cache_lookup(queryDesc->plannedstmt, planid_variant,
+								 &key.planid, &plan_check))
+		planid_known = true;
+	else if (plan_fingerprint == PLAN_FINGERPRINT_TREE)
+	{
+		key.planid = pgsp_plan_fingerprint(queryDesc->plannedstmt,
+										   log_verbose, planid_flags,
+										   &plan_check);
+		pgsp_planid_cache_store(queryDesc->plannedstmt, planid_variant,
+								key.planid, plan_check, planid_cache_size);
+		planid_known = true;
+	}
+	else if (use_cache && !refresh_plan &&
+			 (verify_rate < 1.0 || sample_adaptive) &&
+			 pgsp_sample_skip((uint64) queryId, planid_variant, verify_rate,
+							  sample_adaptive, &key.planid))
+	{
+		/*
+		 * This execution is not sampled. Assume that the plan is the same as
+		 * the last verified one of this query.
+		 */
+		planid_known = true;
+		planid_sampled = true;
+	}
+
+retry:
+	if (!planid_known)
+	{
+		plan = pgsp_explain_plan(queryDesc);
+		key.planid = pgsp_json_normalized_hash(plan, planid_flags, NULL,
+											   &plan_check);
+
+		if (use_cache)
+			pgsp_planid_cache_store(queryDesc->plannedstmt, planid_variant,
+									key.planid, plan_check,
+									planid_cache_size);
+		if (use_cache && track_last_plan)
+			pgsp_sample_verified((uint64) queryId, planid_variant, key.planid,
+								 sample_rate, planid_cache_size);
+	}
+
+	/*
+	 * Counters of entries known to exist are accumulated locally if
+	 * requested, without touching shared memory.
+	 */
+	if (flush_interval > 0 && !refresh_plan &&
+		(pending = pending_find(&key, false)) != NULL)
+	{
+		counters_accum(&pending->counters, &delta);
+		counters_accum_additive(&pending->counters, &delta);
+		pending_flush(false);
+
+		if (plan)
+			pfree(plan);
+		return;
+	}
+
+	/*
+	 * Most executions find their entry already there. Try it first so that
+	 * we don't need to explain nor shorten the plan for them.
+	 */
+	part = entry_partition(&key);
+	lock = PARTITION_LOCK(part);
+	LWLockAcquire(lock, LW_SHARED);
+
+	entry = entry_find(part, &key);
+	if (entry)
+	{
+		/*
+		 * The check value is not known for sampled-out executions.  The one
+		 * of the entry never changes once set.
+		 */
+		if (plan_check != 0 && entry->plan_check != 0 &&
+			entry->plan_check != plan_check)
+		{
+			count_collision(&key);
+			refresh_plan = false;
+		}
+
+		entry_update(entry, &delta);
+		LWLockRelease(lock);
+
+		if (refresh_plan)
+		{
+			if (!plan)
+				plan = pgsp_explain_plan(queryDesc);
+			entry_refresh_plan(part, &key, plan);
+		}
+
+		/* Following executions can be counted locally */
+		if (flush_interval > 0)
+			(void) pending_find(&key, true);
+
+		if (plan)
+			pfree(plan);
+		return;
+	}
+
+	LWLockRelease(lock);
+
+	/*
+	 * The assumed plan id is not trustworthy enough to create a new entry
+	 * with. Calculate it from the actual plan.
+	 */
+	if (planid_sampled)
+	{
+		planid_known = planid_sampled = false;
+		plan_check = 0;
+		goto retry;
+	}
+
+	/* We are going to create a new entry, prepare the plan text */
+	if (!plan)
+		plan = pgsp_explain_plan(queryDesc);
 	shorten_plan = pgsp_json_shorten(plan);
-	elog(DEBUG3, "pg_store_plans: Normalized plan: %s", normalized_plan);
+
 	elog(DEBUG3, "pg_store_plans: Shorten plan: %s", shorten_plan);
 	elog(DEBUG3, "pg_store_plans: Original plan: %s", plan);
 	plan_len = strlen(shorten_plan);
+	stored_plan = plan_compress(shorten_plan, &plan_len, GetDatabaseEncoding());
 
-	key.planid = hash_any((const unsigned char *)normalized_plan,
-						  strlen(normalized_plan));
-	pfree(normalized_plan);
-
-	if (plan_len >= shared_state->plan_size)
-		plan_len = pg_encoding_mbcliplen(GetDatabaseEncoding(),
-										 shorten_plan,
-										 plan_len,
-										 shared_state->plan_size - 1);
-
-
-	/* Look up the hash table entry with shared lock. */
-	LWLockAcquire(shared_state->lock, LW_SHARED);
+	/*
+	 * Look up the hash table entry again with shared lock. Someone may have
+	 * created it while we weren't holding the lock.
+	 */
+	LWLockAcquire(lock, LW_SHARED);
 
-	entry = (pgspEntry *) hash_search(hash_table, &key, HASH_FIND, NULL);
+	entry = entry_find(part, &key);
 
 	/* Store the plan text, if the entry not present */
 	if (!entry && plan_storage == PLAN_STORAGE_FILE)
 	{
-		int		gc_count;
+		int		gc_count = shared_state->gc_count;
+		int		shared_len;
+		bool	shared;
 		bool	stored;
 
-		/* Append new plan text to file with only shared lock held */
-		stored = ptext_store(shorten_plan, plan_len, &plan_offset, &gc_count);
+		/*
+		 * Use the text of the same plan stored for another user or database
+		 * if any, otherwise append new plan text to file with only shared
+		 * lock held.
+		 */
+		shared = ptext_lookup(&key, &plan_offset, &shared_len);
+		stored = (shared ||
+				  ptext_store(stored_plan, plan_len, &plan_offset, &gc_count));
 
 		/*
 		 * Determine whether we need to garbage collect external query texts
@@ -1271,121 +2831,575 @@ pgsp_store(char *plan, queryid_t queryId,
 		do_gc = need_gc_ptexts();
 
 		/* Acquire exclusive lock as required by entry_alloc() */
-		LWLockRelease(shared_state->lock);
-		LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+		LWLockRelease(lock);
+		LWLockAcquire(lock, LW_EXCLUSIVE);
 
 		/*
 		 * A garbage collection may have occurred while we weren't holding the
 		 * lock.  In the unlikely event that this happens, the plan text we
-		 * stored above will have been garbage collected, so write it again.
-		 * This should be infrequent enough that doing it while holding
-		 * exclusive lock isn't a performance problem.
+		 * stored or found above will have been garbage collected, so write
+		 * it again.  This should be infrequent enough that doing it while
+		 * holding exclusive lock isn't a performance problem.
+		 *
+		 * Likewise, a background garbage collection may have copied this
+		 * partition meanwhile, and will then drop the text if it lies below
+		 * the boundary of the gc.  This is the case even for a text found
+		 * above, since the entries referencing it may have gone away since.
 		 */
-		if (!stored || shared_state->gc_count != gc_count)
-			stored = ptext_store(shorten_plan, plan_len, &plan_offset, NULL);
+		if (!stored || shared_state->gc_count != gc_count ||
+			ptext_behind_gc(plan_offset))
+		{
+			shared = false;
+			stored = ptext_store(stored_plan, plan_len, &plan_offset, NULL);
+		}
 
 		/* If we failed to write to the text file, give up */
 		if (!stored)
 			goto done;
 
+		if (shared)
+			plan_len = shared_len;
+
+	}
+	else if (!entry && plan_storage == PLAN_STORAGE_DSA)
+	{
+		/* Copy the plan text into DSA with only shared lock held */
+		bool	stored = ptext_dsa_store(stored_plan, plan_len, &plan_offset);
+
+		/* Acquire exclusive lock as required by entry_alloc() */
+		LWLockRelease(lock);
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+
+		/* If we ran out of shared memory, give up */
+		if (!stored)
+			goto done;
+	}
+	else if (!entry)
+	{
+		/* Acquire exclusive lock as required by entry_alloc() */
+		LWLockRelease(lock);
+		LWLockAcquire(lock, LW_EXCLUSIVE);
 	}
 
 	/* Create new entry, if not present */
 	if (!entry)
 	{
-		entry = entry_alloc(&key, plan_offset, plan_len, false);
+		entry = entry_alloc(&key, plan_offset, plan_len, plan_check, false);
 
-		/* shorten_plan is terminated by NUL */
 		if (plan_storage == PLAN_STORAGE_SHMEM)
-			memcpy(SHMEM_PLAN_PTR(entry), shorten_plan, plan_len + 1);
-			
+		{
+			memcpy(SHMEM_PLAN_PTR(entry), stored_plan, plan_len);
+			SHMEM_PLAN_PTR(entry)[plan_len] = '\0';
+		}
+
+		/* Someone may have created the entry meanwhile */
+		if (plan_storage == PLAN_STORAGE_DSA &&
+			entry->plan_offset != plan_offset)
+			ptext_dsa_free(plan_offset);
+	}
+
+	entry_update(entry, &delta);
+	updated = true;
+
+done:
+	LWLockRelease(lock);
+
+	/*
+	 * If needed, perform garbage collection. It needs all partitions locked
+	 * exclusively, so this is done after releasing the lock above.
+	 */
+	if (updated && do_gc)
+		run_gc_ptexts();
+
+	/* Following executions can be counted locally */
+	if (updated && flush_interval > 0)
+		(void) pending_find(&key, true);
+
+	/* We postpone this pfree until we're out of the lock */
+	if (stored_plan != shorten_plan)
+		pfree(stored_plan);
+	pfree(shorten_plan);
+	pfree(plan);
+}
+
+/*
+ * Replace the plan text of an existing entry.  Nothing is done if the entry
+ * has gone away in the meantime.  The old text in the external file is left
+ * to garbage collection.
+ */
+static void
+entry_refresh_plan(int part, pgspHashKey *key, const char *plan)
+{
+	LWLock	   *lock = PARTITION_LOCK(part);
+	pgspEntry  *entry;
+	char	   *shorten_plan;
+	char	   *stored_plan;
+	int			plan_len;
+	Size		plan_offset = 0;
+	bool		do_gc = false;
+
+	shorten_plan = pgsp_json_shorten(plan);
+	plan_len = strlen(shorten_plan);
+	stored_plan = plan_compress(shorten_plan, &plan_len, GetDatabaseEncoding());
+
+	if (plan_storage == PLAN_STORAGE_FILE)
+	{
+		int		gc_count;
+		bool	stored;
+
+		/* The same steps as pgsp_store() takes for a new entry */
+		LWLockAcquire(lock, LW_SHARED);
+		stored = ptext_store(stored_plan, plan_len, &plan_offset, &gc_count);
+		do_gc = need_gc_ptexts();
+		LWLockRelease(lock);
+
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+		if (!stored || shared_state->gc_count != gc_count ||
+			ptext_behind_gc(plan_offset))
+			stored = ptext_store(stored_plan, plan_len, &plan_offset, NULL);
+
+		if (!stored)
+		{
+			LWLockRelease(lock);
+			if (stored_plan != shorten_plan)
+				pfree(stored_plan);
+			pfree(shorten_plan);
+			return;
+		}
+	}
+	else if (plan_storage == PLAN_STORAGE_DSA)
+	{
+		if (!ptext_dsa_store(stored_plan, plan_len, &plan_offset))
+		{
+			if (stored_plan != shorten_plan)
+				pfree(stored_plan);
+			pfree(shorten_plan);
+			return;
+		}
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+	}
+	else
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+
+	entry = entry_find(part, key);
+	if (entry)
+	{
+		if (plan_storage == PLAN_STORAGE_SHMEM)
+		{
+			memcpy(SHMEM_PLAN_PTR(entry), stored_plan, plan_len);
+			SHMEM_PLAN_PTR(entry)[plan_len] = '\0';
+			entry->plan_len = plan_len;
+		}
+		else if (plan_storage == PLAN_STORAGE_DSA)
+		{
+			/* Nobody can be reading the old text under our lock */
+			ptext_dsa_free(entry->plan_offset);
+			entry->plan_offset = plan_offset;
+			entry->plan_len = plan_len;
+		}
+		else
+		{
+			entry->plan_offset = plan_offset;
+			entry->plan_len = plan_len;
+
+			/* Other entries sharing the text follow it at next gc */
+			ptext_update(entry);
+		}
+	}
+	else if (plan_storage == PLAN_STORAGE_DSA)
+		ptext_dsa_free(plan_offset);
+
+	LWLockRelease(lock);
+
+	if (entry && do_gc)
+		run_gc_ptexts();
+
+	if (stored_plan != shorten_plan)
+		pfree(stored_plan);
+	pfree(shorten_plan);
+}
+
+/*
+ * Set up counters representing a single execution.  bufusage is NULL if buffer
+ * usage was not collected.
+ */
+static void
+counters_set(Counters *counters, double total_time, uint64 rows,
+			 const BufferUsage *bufusage)
+{
+	memset(counters, 0, sizeof(Counters));
+
+	counters->calls = 1;
+	counters->total_time = total_time;
+	counters->min_time = total_time;
+	counters->max_time = total_time;
+	counters->mean_time = total_time;
+	counters->sum_var_time = 0.0;
+
+	counters->rows = rows;
+	counters->first_call = counters->last_call = GetCurrentTimestamp();
+	counters->usage = USAGE_EXEC(total_time);
+
+	if (bufusage == NULL)
+		return;
+
+	counters->buffers_collected = true;
+	counters->shared_blks_hit = bufusage->shared_blks_hit;
+	counters->shared_blks_read = bufusage->shared_blks_read;
+	counters->shared_blks_dirtied = bufusage->shared_blks_dirtied;
+	counters->shared_blks_written = bufusage->shared_blks_written;
+	counters->local_blks_hit = bufusage->local_blks_hit;
+	counters->local_blks_read = bufusage->local_blks_read;
+	counters->local_blks_dirtied = bufusage->local_blks_dirtied;
+	counters->local_blks_written = bufusage->local_blks_written;
+	counters->temp_blks_read = bufusage->temp_blks_read;
+	counters->temp_blks_written = bufusage->temp_blks_written;
+
+#if PG_VERSION_NUM >= 170000
+	counters->shared_blk_read_time = INSTR_TIME_GET_MILLISEC(bufusage->shared_blk_read_time);
+	counters->shared_blk_write_time = INSTR_TIME_GET_MILLISEC(bufusage->shared_blk_write_time);
+#else
+	counters->shared_blk_read_time = INSTR_TIME_GET_MILLISEC(bufusage->blk_read_time);
+	counters->shared_blk_write_time = INSTR_TIME_GET_MILLISEC(bufusage->blk_write_time);
+#endif
+
+#if PG_VERSION_NUM >= 150000
+	counters->temp_blk_read_time = INSTR_TIME_GET_MILLISEC(bufusage->temp_blk_read_time);
+	counters->temp_blk_write_time = INSTR_TIME_GET_MILLISEC(bufusage->temp_blk_write_time);
+#endif
+}
+
+/*
+ * Accumulate counters of a set of executions into other counters, except the
+ * additive ones kept in pgspAtomicCounters in shared entries.
+ *
+ * The caller is responsible for locking.  Usage of sticky entries is not
+ * taken care of here.
+ */
+static void
+counters_accum(volatile Counters *counters, const Counters *delta)
+{
+	if (delta->calls == 0)
+		return;
 
-		/* If needed, perform garbage collection while exclusive lock held */
-		if (do_gc)
-			gc_ptexts();
+	if (counters->calls == 0)
+	{
+		counters->min_time = delta->min_time;
+		counters->max_time = delta->max_time;
+		counters->mean_time = delta->mean_time;
+		counters->sum_var_time = delta->sum_var_time;
+		counters->first_call = delta->first_call;
 	}
+	else
+	{
+		/*
+		 * Combine the means and the sums of variances of the two sets by the
+		 * parallel variant of Welford's method, which results in the same as
+		 * Welford's method when delta is a single execution. See
+		 * <https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance>
+		 */
+		double		n1 = (double) counters->calls;
+		double		n2 = (double) delta->calls;
+		double		diff = delta->mean_time - counters->mean_time;
 
-	/* Increment the counts, except when jstate is not NULL */
+		counters->mean_time += diff * n2 / (n1 + n2);
+		counters->sum_var_time +=
+			delta->sum_var_time + diff * diff * n1 * n2 / (n1 + n2);
+
+		/* calculate min and max time */
+		if (counters->min_time > delta->min_time)
+			counters->min_time = delta->min_time;
+		if (counters->max_time < delta->max_time)
+			counters->max_time = delta->max_time;
+	}
+
+	counters->calls += delta->calls;
+	counters->total_time += delta->total_time;
+	counters->shared_blk_read_time += delta->shared_blk_read_time;
+	counters->shared_blk_write_time += delta->shared_blk_write_time;
+	counters->temp_blk_read_time += delta->temp_blk_read_time;
+	counters->temp_blk_write_time += delta->temp_blk_write_time;
+	if (delta->buffers_collected)
+		counters->buffers_collected = true;
+
+	if (counters->last_call < delta->last_call)
+		counters->last_call = delta->last_call;
+	counters->usage += delta->usage;
+}
+
+/*
+ * Accumulate the additive counters, which are not taken care of by
+ * counters_accum(), into local counters.
+ */
+static void
+counters_accum_additive(Counters *counters, const Counters *delta)
+{
+	counters->rows += delta->rows;
+	counters->shared_blks_hit += delta->shared_blks_hit;
+	counters->shared_blks_read += delta->shared_blks_read;
+	counters->shared_blks_dirtied += delta->shared_blks_dirtied;
+	counters->shared_blks_written += delta->shared_blks_written;
+	counters->local_blks_hit += delta->local_blks_hit;
+	counters->local_blks_read += delta->local_blks_read;
+	counters->local_blks_dirtied += delta->local_blks_dirtied;
+	counters->local_blks_written += delta->local_blks_written;
+	counters->temp_blks_read += delta->temp_blks_read;
+	counters->temp_blks_written += delta->temp_blks_written;
+}
+
+/*
+ * Initialize the atomic counters of an entry with the given values.
+ */
+static void
+atomic_counters_init(pgspAtomicCounters *acounters, const Counters *counters)
+{
+	pg_atomic_init_u64(&acounters->rows, counters->rows);
+	pg_atomic_init_u64(&acounters->shared_blks_hit, counters->shared_blks_hit);
+	pg_atomic_init_u64(&acounters->shared_blks_read, counters->shared_blks_read);
+	pg_atomic_init_u64(&acounters->shared_blks_dirtied, counters->shared_blks_dirtied);
+	pg_atomic_init_u64(&acounters->shared_blks_written, counters->shared_blks_written);
+	pg_atomic_init_u64(&acounters->local_blks_hit, counters->local_blks_hit);
+	pg_atomic_init_u64(&acounters->local_blks_read, counters->local_blks_read);
+	pg_atomic_init_u64(&acounters->local_blks_dirtied, counters->local_blks_dirtied);
+	pg_atomic_init_u64(&acounters->local_blks_written, counters->local_blks_written);
+	pg_atomic_init_u64(&acounters->temp_blks_read, counters->temp_blks_read);
+	pg_atomic_init_u64(&acounters->temp_blks_written, counters->temp_blks_written);
+}
+
+/*
+ * Add the additive counters to the atomic counters of an entry.  Zero values,
+ * which are common for block counters, are skipped.
+ */
+#define ATOMIC_COUNTER_ADD(a, c, field) \
+	do { \
+		if ((c)->field != 0) \
+			pg_atomic_fetch_add_u64(&(a)->field, (c)->field); \
+	} while (0)
+
+static void
+atomic_counters_add(pgspAtomicCounters *acounters, const Counters *delta)
+{
+	ATOMIC_COUNTER_ADD(acounters, delta, rows);
+	ATOMIC_COUNTER_ADD(acounters, delta, shared_blks_hit);
+	ATOMIC_COUNTER_ADD(acounters, delta, shared_blks_read);
+	ATOMIC_COUNTER_ADD(acounters, delta, shared_blks_dirtied);
+	ATOMIC_COUNTER_ADD(acounters, delta, shared_blks_written);
+	ATOMIC_COUNTER_ADD(acounters, delta, local_blks_hit);
+	ATOMIC_COUNTER_ADD(acounters, delta, local_blks_read);
+	ATOMIC_COUNTER_ADD(acounters, delta, local_blks_dirtied);
+	ATOMIC_COUNTER_ADD(acounters, delta, local_blks_written);
+	ATOMIC_COUNTER_ADD(acounters, delta, temp_blks_read);
+	ATOMIC_COUNTER_ADD(acounters, delta, temp_blks_written);
+}
+
+/*
+ * Read the atomic counters of an entry into counters.  The values may be
+ * slightly inconsistent with each other and with other counters while the
+ * entry is being updated, which is acceptable for statistics.
+ */
+static void
+atomic_counters_read(pgspAtomicCounters *acounters, Counters *counters)
+{
+	counters->rows = pg_atomic_read_u64(&acounters->rows);
+	counters->shared_blks_hit = pg_atomic_read_u64(&acounters->shared_blks_hit);
+	counters->shared_blks_read = pg_atomic_read_u64(&acounters->shared_blks_read);
+	counters->shared_blks_dirtied = pg_atomic_read_u64(&acounters->shared_blks_dirtied);
+	counters->shared_blks_written = pg_atomic_read_u64(&acounters->shared_blks_written);
+	counters->local_blks_hit = pg_atomic_read_u64(&acounters->local_blks_hit);
+	counters->local_blks_read = pg_atomic_read_u64(&acounters->local_blks_read);
+	counters->local_blks_dirtied = pg_atomic_read_u64(&acounters->local_blks_dirtied);
+	counters->local_blks_written = pg_atomic_read_u64(&acounters->local_blks_written);
+	counters->temp_blks_read = pg_atomic_read_u64(&acounters->temp_blks_read);
+	counters->temp_blks_written = pg_atomic_read_u64(&acounters->temp_blks_written);
+}
+
+/*
+ * Accumulate the statistics of executions into an entry.
+ *
+ * Caller must hold at least a shared lock on the partition of the entry.
+ */
+static void
+entry_update(pgspEntry *entry, const Counters *delta)
+{
+	volatile pgspEntry *e;
 
 	/*
 	 * Grab the spinlock while updating the counters (see comment about
 	 * locking rules at the head of the file)
 	 */
 
+	/* Additive counters don't need the spinlock */
+	atomic_counters_add(&entry->acounters, delta);
+
 	e = (volatile pgspEntry *) entry;
 	SpinLockAcquire(&e->mutex);
 
 	/* "Unstick" entry if it was previously sticky */
 	if (e->counters.calls == 0)
-	{
 		e->counters.usage = USAGE_INIT;
-		e->counters.first_call = GetCurrentTimestamp();
-	}
 
-	e->counters.calls += 1;
-	e->counters.total_time += total_time;
-	if (e->counters.calls == 1)
+	counters_accum(&e->counters, delta);
+
+	SpinLockRelease(&e->mutex);
+}
+
+/*
+ * Count a plan id collision, which is found when an entry has a different
+ * check value from the plan being stored.  The plans are still counted in the
+ * same entry.
+ */
+static void
+count_collision(pgspHashKey *key)
+{
+	volatile pgspSharedState *s = (volatile pgspSharedState *) shared_state;
+
+	elog(DEBUG1, "pg_store_plans: plan id collision detected: queryid "
+		 UINT64_FORMAT ", planid " UINT64_FORMAT,
+		 (uint64) key->queryid, key->planid);
+
+	SpinLockAcquire(&s->mutex);
+	s->stats.collisions += 1;
+	SpinLockRelease(&s->mutex);
+}
+
+/*
+ * Find the local counters for an entry, creating them if create is true.
+ *
+ * Creation is silently skipped if the backend already has as many local
+ * counters as pg_store_plans.max.
+ */
+static pgspPendingEntry *
+pending_find(pgspHashKey *key, bool create)
+{
+	pgspPendingEntry *pending;
+
+	if (pending_table == NULL)
 	{
-		e->counters.min_time = total_time;
-		e->counters.max_time = total_time;
-		e->counters.mean_time = total_time;
+		HASHCTL		ctl;
+		static bool	callbacks_registered = false;
+
+		if (!create)
+			return NULL;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(pgspHashKey);
+		ctl.entrysize = sizeof(pgspPendingEntry);
+		pending_table = hash_create("pg_store_plans pending counters", 64,
+									&ctl, HASH_ELEM | HASH_BLOBS);
+		last_flush = GetCurrentTimestamp();
+
+		/* Flush local counters at commit and at exit */
+		if (!callbacks_registered)
+		{
+			RegisterXactCallback(pgsp_xact_callback, NULL);
+			before_shmem_exit(pgsp_pending_exit, (Datum) 0);
+			callbacks_registered = true;
+		}
 	}
-	else
+
+	pending = (pgspPendingEntry *)
+		hash_search(pending_table, key, HASH_FIND, NULL);
+
+	if (pending || !create ||
+		hash_get_num_entries(pending_table) >= store_size)
+		return pending;
+
+	pending = (pgspPendingEntry *)
+		hash_search(pending_table, key, HASH_ENTER, NULL);
+	memset(&pending->counters, 0, sizeof(Counters));
+
+	return pending;
+}
+
+/*
+ * Flush local counters into the shared entries if flush_interval has elapsed
+ * since the last flush or force is true.
+ *
+ * Local counters are forgotten when the shared entry has gone or they are
+ * not used since the last flush, so that the table doesn't bloat.
+ */
+static void
+pending_flush(bool force)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgspPendingEntry *pending;
+	TimestampTz now;
+
+	if (pending_table == NULL || !TABLE_READY())
+		return;
+
+	now = GetCurrentTimestamp();
+	if (!force && !TimestampDifferenceExceeds(last_flush, now, flush_interval))
+		return;
+	last_flush = now;
+
+	hash_seq_init(&hash_seq, pending_table);
+	while ((pending = hash_seq_search(&hash_seq)) != NULL)
 	{
-		/*
-		 * Welford's method for accurately computing variance. See
-		 * <http://www.johndcook.com/blog/standard_deviation/>
-		 */
-		double		old_mean = e->counters.mean_time;
+		pgspEntry  *entry;
+		int			part = entry_partition(&pending->key);
+		bool		keep = false;
 
-		e->counters.mean_time +=
-			(total_time - old_mean) / e->counters.calls;
-		e->counters.sum_var_time +=
-			(total_time - old_mean) * (total_time - e->counters.mean_time);
+		LWLockAcquire(PARTITION_LOCK(part), LW_SHARED);
 
-		/* calculate min and max time */
-		if (e->counters.min_time > total_time)
-			e->counters.min_time = total_time;
-		if (e->counters.max_time < total_time)
-			e->counters.max_time = total_time;
-	}
-
-	e->counters.rows += rows;
-	e->counters.shared_blks_hit += bufusage->shared_blks_hit;
-	e->counters.shared_blks_read += bufusage->shared_blks_read;
-	e->counters.shared_blks_dirtied += bufusage->shared_blks_dirtied;
-	e->counters.shared_blks_written += bufusage->shared_blks_written;
-	e->counters.local_blks_hit += bufusage->local_blks_hit;
-	e->counters.local_blks_read += bufusage->local_blks_read;
-	e->counters.local_blks_dirtied += bufusage->local_blks_dirtied;
-	e->counters.local_blks_written += bufusage->local_blks_written;
-	e->counters.temp_blks_read += bufusage->temp_blks_read;
-	e->counters.temp_blks_written += bufusage->temp_blks_written;
+		entry = entry_find(part, &pending->key);
 
-#if PG_VERSION_NUM >= 170000
-	e->counters.shared_blk_read_time += INSTR_TIME_GET_MILLISEC(bufusage->shared_blk_read_time);
-	e->counters.shared_blk_write_time += INSTR_TIME_GET_MILLISEC(bufusage->shared_blk_write_time);
-#else
-	e->counters.shared_blk_read_time += INSTR_TIME_GET_MILLISEC(bufusage->blk_read_time);
-	e->counters.shared_blk_write_time += INSTR_TIME_GET_MILLISEC(bufusage->blk_write_time);
-#endif
+		if (entry && pending->counters.calls > 0)
+		{
+			entry_update(entry, &pending->counters);
+			memset(&pending->counters, 0, sizeof(Counters));
+			keep = (flush_interval > 0);
+		}
 
-#if PG_VERSION_NUM >= 150000
-	e->counters.temp_blk_read_time += INSTR_TIME_GET_MILLISEC(bufusage->temp_blk_read_time);
-	e->counters.temp_blk_write_time += INSTR_TIME_GET_MILLISEC(bufusage->temp_blk_write_time);
-#endif
+		LWLockRelease(PARTITION_LOCK(part));
 
-	e->counters.last_call = GetCurrentTimestamp();
-	e->counters.usage += USAGE_EXEC(total_time);
+		if (!keep)
+			hash_search(pending_table, &pending->key, HASH_REMOVE, NULL);
+	}
+}
 
-	SpinLockRelease(&e->mutex);
+/*
+ * Throw away all local counters.
+ */
+static void
+pending_discard(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgspPendingEntry *pending;
 
-done:
-	LWLockRelease(shared_state->lock);
+	if (pending_table == NULL)
+		return;
 
-	/* We postpone this pfree until we're out of the lock */
-	if (norm_query)
-		pfree(norm_query);
+	hash_seq_init(&hash_seq, pending_table);
+	while ((pending = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(pending_table, &pending->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Transaction callback: flush local counters if it's time to do.
+ *
+ * This is not done at abort, where we might still be holding a partition
+ * lock; the counters wait for the next commit or execution.
+ */
+static void
+pgsp_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_COMMIT)
+		pending_flush(false);
+}
+
+/*
+ * Flush all local counters at backend exit.
+ *
+ * This runs before the open transaction, if any, is aborted, so release any
+ * LWLocks left held by an error first, as pending_flush() takes partition
+ * locks.
+ */
+static void
+pgsp_pending_exit(int code, Datum arg)
+{
+	LWLockReleaseAll();
+	pending_flush(true);
 }
 
 /*
@@ -1394,7 +3408,7 @@ done:
 Datum
 pg_store_plans_reset(PG_FUNCTION_ARGS)
 {
-	if (!shared_state || !hash_table)
+	if (!TABLE_READY())
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_store_plans must be loaded via shared_preload_libraries")));
@@ -1451,14 +3465,18 @@ pg_store_plans_internal(FunctionCallInfo fcinfo,
 	Size		pbuffer_size = 0;
 	Size		extent = 0;
 	int			gc_count = 0;
-	HASH_SEQ_STATUS hash_seq;
+	pgspEntryScan scan;
 	pgspEntry  *entry;
+	int			part;
 
-	if (!shared_state || !hash_table)
+	if (!TABLE_READY())
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_store_plans must be loaded via shared_preload_libraries")));
 
+	/* Show the counters of this backend up to date */
+	pending_flush(true);
+
 	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
 		ereport(ERROR,
@@ -1486,7 +3504,7 @@ pg_store_plans_internal(FunctionCallInfo fcinfo,
 
 	/*
 	 * We'd like to load the plan text file (if needed) while not holding any
-	 * lock on shared_state->lock.  In the worst case we'll have to do this
+	 * partition lock.  In the worst case we'll have to do this
 	 * again after we have the lock, but it's unlikely enough to make this a
 	 * win despite occasional duplicated work.  We need to reload if anybody
 	 * writes to the file (either a retail ptext_store(), or a garbage
@@ -1506,194 +3524,230 @@ pg_store_plans_internal(FunctionCallInfo fcinfo,
 		SpinLockRelease(&s->mutex);
 	}
 
-	/* No point in loading file now if there are active writers */
+	/* No point in mapping file now if there are active writers */
 	if (n_writers == 0 && plan_storage == PLAN_STORAGE_FILE)
-		pbuffer = ptext_load_file(&pbuffer_size);
+		pbuffer = ptext_map_file(&pbuffer_size);
 
 	/*
-	 * Get shared lock, load or reload the plan text file if we must, and
-	 * iterate over the hashtable entries.
+	 * For each partition, get shared lock, map or remap the plan text file
+	 * if we must, and iterate over the hashtable entries.
 	 *
-	 * With a large hash table, we might be holding the lock rather longer
-	 * than one could wish.  However, this only blocks creation of new hash
-	 * table entries, and the larger the hash table the less likely that is to
-	 * be needed.  So we can hope this is okay.  Perhaps someday we'll decide
-	 * we need to partition the hash table to limit the time spent holding any
-	 * one lock.
+	 * With a large partition, we might be holding the lock rather longer than
+	 * one could wish.  However, this only blocks creation of new hash table
+	 * entries in the partition, and the larger the hash table the less likely
+	 * that is to be needed.  So we can hope this is okay.
 	 */
-	LWLockAcquire(shared_state->lock, LW_SHARED);
-
-	/*
-	 * Here it is safe to examine extent and gc_count without taking the mutex.
-	 * Note that although other processes might change shared_state->extent
-	 * just after we look at it, the strings they then write into the file
-	 * cannot yet be referenced in the hashtable, so we don't care whether we
-	 * see them or not.
-	 *
-	 * If ptext_load_file fails, we just press on; we'll return NULL for every
-	 * plan text.
-	 */
-	if (plan_storage == PLAN_STORAGE_FILE &&
-		(pbuffer == NULL ||
-		 shared_state->extent != extent ||
-		 shared_state->gc_count != gc_count))
+	for (part = 0 ; part < num_partitions ; part++)
 	{
-		if (pbuffer)
-			free(pbuffer);
-		pbuffer = ptext_load_file(&pbuffer_size);
-	}
-
-	hash_seq_init(&hash_seq, hash_table);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		Datum		values[PG_STORE_PLANS_COLS];
-		bool		nulls[PG_STORE_PLANS_COLS];
-		int			i = 0;
-		int64		queryid      = entry->key.queryid;
-		int64		planid       = entry->key.planid;
-		Counters	tmp;
-		double		stddev;
-
-		memset(values, 0, sizeof(values));
-		memset(nulls, 0, sizeof(nulls));
+		LWLockAcquire(PARTITION_LOCK(part), LW_SHARED);
 
-		values[i++] = ObjectIdGetDatum(entry->key.userid);
-		values[i++] = ObjectIdGetDatum(entry->key.dbid);
-		if (is_allowed_role || entry->key.userid == userid)
-		{
-			values[i++] = Int64GetDatumFast(queryid);
-			values[i++] = Int64GetDatumFast(planid);
+		/* Let the queued plan texts referenced by entries be in the file */
+		if (plan_storage == PLAN_STORAGE_FILE)
+			ptext_flush();
 
-			/* fill queryid_stat_statements with the same value with queryid */
-			if (api_version == PGSP_V1_5)
-				values[i++] = Int64GetDatumFast(queryid);
-		}
-		else
+		/*
+		 * Here it is safe to examine extent and gc_count without taking the
+		 * mutex, since garbage collection needs all partitions locked.  Note
+		 * that although other processes might change shared_state->extent
+		 * just after we look at it, the strings they then write into the file
+		 * cannot yet be referenced in this partition, so we don't care
+		 * whether we see them or not.
+		 *
+		 * The mapping must not be touched if the file may have been
+		 * truncated since it was made, which only garbage collection and
+		 * reset do.  Remapping is cheap, so it is also redone for the texts
+		 * appended meanwhile.
+		 *
+		 * If ptext_map_file fails, we just press on; we'll return NULL for
+		 * every plan text.
+		 */
+		if (plan_storage == PLAN_STORAGE_FILE &&
+			(pbuffer == NULL ||
+			 shared_state->extent != extent ||
+			 shared_state->gc_count != gc_count))
 		{
-			nulls[i++] = true;	/* queryid */
-			nulls[i++] = true;	/* planid */
-
-			/* queryid_stat_statemetns*/
-			if (api_version == PGSP_V1_5)
-				nulls[i++] = true;
+			if (pbuffer)
+				ptext_unmap_file(pbuffer, pbuffer_size);
+			pbuffer = ptext_map_file(&pbuffer_size);
+			extent = shared_state->extent;
+			gc_count = shared_state->gc_count;
 		}
 
-		if (is_allowed_role || entry->key.userid == userid)
+		entry_scan_init(&scan, part, false);
+		while ((entry = entry_scan_next(&scan)) != NULL)
 		{
-			char	   *pstr; /* Plan string */
-			char	   *mstr; /* Modified plan string */
-			char	   *estr; /* Encoded modified plan string */
+			Datum		values[PG_STORE_PLANS_COLS];
+			bool		nulls[PG_STORE_PLANS_COLS];
+			int			i = 0;
+			int64		queryid      = entry->key.queryid;
+			int64		planid       = entry->key.planid;
+			Counters	tmp;
+			double		stddev;
+			int			buffer_cols;
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			values[i++] = ObjectIdGetDatum(entry->key.userid);
+			values[i++] = ObjectIdGetDatum(entry->key.dbid);
+			if (is_allowed_role || entry->key.userid == userid)
+			{
+				values[i++] = Int64GetDatumFast(queryid);
+				values[i++] = Int64GetDatumFast(planid);
 
-			if (plan_storage == PLAN_STORAGE_FILE)
-				pstr = ptext_fetch(entry->plan_offset, entry->plan_len,
-								   pbuffer, pbuffer_size);
+				/* fill queryid_stat_statements with the same value with queryid */
+				if (api_version == PGSP_V1_5)
+					values[i++] = Int64GetDatumFast(queryid);
+			}
 			else
-				pstr = SHMEM_PLAN_PTR(entry);
-
-			switch (plan_format)
 			{
-				case PLAN_FORMAT_TEXT:
-					mstr = pgsp_json_textize(pstr);
-					break;
-				case PLAN_FORMAT_JSON:
-					mstr = pgsp_json_inflate(pstr);
-					break;
-				case PLAN_FORMAT_YAML:
-					mstr = pgsp_json_yamlize(pstr);
-					break;
-				case PLAN_FORMAT_XML:
-					mstr = pgsp_json_xmlize(pstr);
-					break;
-				default:
-					mstr = pstr;
-					break;
+				nulls[i++] = true;	/* queryid */
+				nulls[i++] = true;	/* planid */
+
+				/* queryid_stat_statemetns*/
+				if (api_version == PGSP_V1_5)
+					nulls[i++] = true;
 			}
 
-			estr = (char *)
-				pg_do_encoding_conversion((unsigned char *) mstr,
-										  strlen(mstr),
-										  entry->encoding,
-										  GetDatabaseEncoding());
-			values[i++] = CStringGetTextDatum(estr);
+			if (is_allowed_role || entry->key.userid == userid)
+			{
+				char	   *sstr; /* Stored plan string */
+				char	   *pstr; /* Plan string */
+				char	   *mstr; /* Modified plan string */
+				char	   *estr; /* Encoded modified plan string */
+
+				sstr = entry_plan_text(entry, pbuffer, pbuffer_size);
+
+				pstr = plan_decompress(sstr, entry->plan_len);
+
+				/* A lost or broken plan text is shown as NULL */
+				if (pstr == NULL)
+					nulls[i++] = true;
+				else
+				{
+					switch (plan_format)
+					{
+						case PLAN_FORMAT_TEXT:
+							mstr = pgsp_json_textize(pstr);
+							break;
+						case PLAN_FORMAT_JSON:
+							mstr = pgsp_json_inflate(pstr);
+							break;
+						case PLAN_FORMAT_YAML:
+							mstr = pgsp_json_yamlize(pstr);
+							break;
+						case PLAN_FORMAT_XML:
+							mstr = pgsp_json_xmlize(pstr);
+							break;
+						default:
+							mstr = pstr;
+							break;
+					}
+
+					estr = (char *)
+						pg_do_encoding_conversion((unsigned char *) mstr,
+												  strlen(mstr),
+												  entry->encoding,
+												  GetDatabaseEncoding());
+					values[i++] = CStringGetTextDatum(estr);
+
+					if (estr != mstr)
+						pfree(estr);
+
+					if (mstr != pstr)
+						pfree(mstr);
+
+					if (pstr != sstr)
+						pfree(pstr);
+				}
+
+				/* sstr is a pointer onto pbuffer or shared memory */
+			}
+			else
+				values[i++] = CStringGetTextDatum("<insufficient privilege>");
 
-			if (estr != mstr)
-				pfree(estr);
+			/* copy counters to a local variable to keep locking time short */
+			{
+				volatile pgspEntry *e = (volatile pgspEntry *) entry;
 
-			if (mstr != pstr)
-				pfree(mstr);
+				SpinLockAcquire(&e->mutex);
+				tmp = e->counters;
+				SpinLockRelease(&e->mutex);
+			}
 
-			/* pstr is a pointer onto pbuffer */
-		}
-		else
-			values[i++] = CStringGetTextDatum("<insufficient privilege>");
+			/* additive counters are read without blocking writers */
+			atomic_counters_read(&entry->acounters, &tmp);
 
-		/* copy counters to a local variable to keep locking time short */
-		{
-			volatile pgspEntry *e = (volatile pgspEntry *) entry;
+			/* Skip entry if unexecuted (ie, it's a pending "sticky" entry) */
+			if (tmp.calls == 0)
+				continue;
 
-			SpinLockAcquire(&e->mutex);
-			tmp = e->counters;
-			SpinLockRelease(&e->mutex);
-		}
+			values[i++] = Int64GetDatumFast(tmp.calls);
+			values[i++] = Float8GetDatumFast(tmp.total_time);
+			values[i++] = Float8GetDatumFast(tmp.min_time);
+			values[i++] = Float8GetDatumFast(tmp.max_time);
+			values[i++] = Float8GetDatumFast(tmp.mean_time);
 
-		/* Skip entry if unexecuted (ie, it's a pending "sticky" entry) */
-		if (tmp.calls == 0)
-			continue;
+			/*
+			 * Note we are calculating the population variance here, not the
+			 * sample variance, as we have data for the whole population, so
+			 * Bessel's correction is not used, and we don't divide by
+			 * tmp.calls - 1.
+			 */
+			if (tmp.calls > 1)
+				stddev = sqrt(tmp.sum_var_time / tmp.calls);
+			else
+				stddev = 0.0;
+			values[i++] = Float8GetDatumFast(stddev);
+
+			values[i++] = Int64GetDatumFast(tmp.rows);
+			buffer_cols = i;
+			values[i++] = Int64GetDatumFast(tmp.shared_blks_hit);
+			values[i++] = Int64GetDatumFast(tmp.shared_blks_read);
+			values[i++] = Int64GetDatumFast(tmp.shared_blks_dirtied);
+			values[i++] = Int64GetDatumFast(tmp.shared_blks_written);
+			values[i++] = Int64GetDatumFast(tmp.local_blks_hit);
+			values[i++] = Int64GetDatumFast(tmp.local_blks_read);
+			values[i++] = Int64GetDatumFast(tmp.local_blks_dirtied);
+			values[i++] = Int64GetDatumFast(tmp.local_blks_written);
+			values[i++] = Int64GetDatumFast(tmp.temp_blks_read);
+			values[i++] = Int64GetDatumFast(tmp.temp_blks_written);
+			values[i++] = Float8GetDatumFast(tmp.shared_blk_read_time);
+			values[i++] = Float8GetDatumFast(tmp.shared_blk_write_time);
+
+			if (api_version >= PGSP_V1_7)
+			{
+				values[i++] = Float8GetDatumFast(tmp.temp_blk_read_time);
+				values[i++] = Float8GetDatumFast(tmp.temp_blk_write_time);
+			}
 
-		values[i++] = Int64GetDatumFast(tmp.calls);
-		values[i++] = Float8GetDatumFast(tmp.total_time);
-		values[i++] = Float8GetDatumFast(tmp.min_time);
-		values[i++] = Float8GetDatumFast(tmp.max_time);
-		values[i++] = Float8GetDatumFast(tmp.mean_time);
+			/* buffer usage is unknown unless it has been collected */
+			if (!tmp.buffers_collected)
+			{
+				while (buffer_cols < i)
+					nulls[buffer_cols++] = true;
+			}
 
-		/*
-		 * Note we are calculating the population variance here, not the
-		 * sample variance, as we have data for the whole population, so
-		 * Bessel's correction is not used, and we don't divide by
-		 * tmp.calls - 1.
-		 */
-		if (tmp.calls > 1)
-			stddev = sqrt(tmp.sum_var_time / tmp.calls);
-		else
-			stddev = 0.0;
-		values[i++] = Float8GetDatumFast(stddev);
-
-		values[i++] = Int64GetDatumFast(tmp.rows);
-		values[i++] = Int64GetDatumFast(tmp.shared_blks_hit);
-		values[i++] = Int64GetDatumFast(tmp.shared_blks_read);
-		values[i++] = Int64GetDatumFast(tmp.shared_blks_dirtied);
-		values[i++] = Int64GetDatumFast(tmp.shared_blks_written);
-		values[i++] = Int64GetDatumFast(tmp.local_blks_hit);
-		values[i++] = Int64GetDatumFast(tmp.local_blks_read);
-		values[i++] = Int64GetDatumFast(tmp.local_blks_dirtied);
-		values[i++] = Int64GetDatumFast(tmp.local_blks_written);
-		values[i++] = Int64GetDatumFast(tmp.temp_blks_read);
-		values[i++] = Int64GetDatumFast(tmp.temp_blks_written);
-		values[i++] = Float8GetDatumFast(tmp.shared_blk_read_time);
-		values[i++] = Float8GetDatumFast(tmp.shared_blk_write_time);
-
-		if (api_version >= PGSP_V1_7)
-		{
-			values[i++] = Float8GetDatumFast(tmp.temp_blk_read_time);
-			values[i++] = Float8GetDatumFast(tmp.temp_blk_write_time);
-		}
+			values[i++] = TimestampTzGetDatum(tmp.first_call);
+			values[i++] = TimestampTzGetDatum(tmp.last_call);
 
-		values[i++] = TimestampTzGetDatum(tmp.first_call);
-		values[i++] = TimestampTzGetDatum(tmp.last_call);
+			Assert(i == (api_version == PGSP_V1_5 ? PG_STORE_PLANS_COLS_V1_5 :
+						 api_version == PGSP_V1_6 ? PG_STORE_PLANS_COLS_V1_6 :
+						 api_version == PGSP_V1_7 ? PG_STORE_PLANS_COLS_V1_7 :
+						 -1 /* fail if you forget to update this assert */ ));
 
-		Assert(i == (api_version == PGSP_V1_5 ? PG_STORE_PLANS_COLS_V1_5 :
-					 api_version == PGSP_V1_6 ? PG_STORE_PLANS_COLS_V1_6 :
-					 api_version == PGSP_V1_7 ? PG_STORE_PLANS_COLS_V1_7 :
-					 -1 /* fail if you forget to update this assert */ ));
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
 
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		LWLockRelease(PARTITION_LOCK(part));
 	}
 
-	LWLockRelease(shared_state->lock);
+	if (pbuffer)
+		ptext_unmap_file(pbuffer, pbuffer_size);
 }
 
 /* Number of output arguments (columns) for pg_stat_statements_info */
-#define PG_STORE_PLANS_INFO_COLS	2
+#define PG_STORE_PLANS_INFO_COLS	3
 
 /*
  * Return statistics of pg_stat_statements.
@@ -1706,7 +3760,7 @@ pg_store_plans_info(PG_FUNCTION_ARGS)
 	Datum		values[PG_STORE_PLANS_INFO_COLS];
 	bool		nulls[PG_STORE_PLANS_INFO_COLS];
 
-	if (!shared_state || !hash_table)
+	if (!TABLE_READY())
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_store_plans must be loaded via shared_preload_libraries")));
@@ -1730,6 +3784,9 @@ pg_store_plans_info(PG_FUNCTION_ARGS)
 	values[0] = Int64GetDatum(stats.dealloc);
 	values[1] = TimestampTzGetDatum(stats.stats_reset);
 
+	/* Ignored if the installed version of the extension is older than 1.9 */
+	values[2] = Int64GetDatum(stats.collisions);
+
 	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
@@ -1745,18 +3802,341 @@ shared_mem_size(void)
 	size = MAXALIGN(sizeof(pgspSharedState));
 	entry_size = sizeof(pgspEntry);
 
-	/* plan text is apppended to the struct body */
-	if (plan_storage == PLAN_STORAGE_SHMEM)
-		entry_size += max_plan_len;
+	/* plan text is apppended to the struct body */
+	if (plan_storage == PLAN_STORAGE_SHMEM)
+		entry_size += max_plan_len;
+
+	/*
+	 * The dynamic hash table starts small and grows in DSA as needed, and so
+	 * do plan texts in DSA.
+	 */
+	if (ENTRIES_IN_DSA())
+		size = add_size(size, PGSP_DSA_INITIAL_SIZE);
+	if (!dynamic_table)
+		size = add_size(size, mul_size(num_partitions,
+									   hash_estimate_size(partition_size,
+														  entry_size)));
+
+	/* The shared plan text table can hold a text for every entry */
+	if (plan_storage == PLAN_STORAGE_FILE)
+		size = add_size(size, hash_estimate_size(store_size,
+												 sizeof(pgspPlanText)));
+
+	if (PLAN_WRITER_ENABLED())
+		size = add_size(size, (Size) writer_queue_size * 1024);
+
+	return size;
+}
+
+/*
+ * Return the hashtable partition the key belongs to.
+ *
+ * Bits used to select buckets within a partition are avoided so that entries
+ * don't gather in a part of the buckets.
+ */
+static int
+entry_partition(pgspHashKey *key)
+{
+	uint32		hashcode = tag_hash(key, sizeof(pgspHashKey));
+
+	return (hashcode >> 16) % num_partitions;
+}
+
+/*
+ * Acquire locks on all partitions in a fixed order.
+ */
+static void
+lock_all_partitions(LWLockMode mode)
+{
+	int			part;
+
+	for (part = 0 ; part < num_partitions ; part++)
+		LWLockAcquire(PARTITION_LOCK(part), mode);
+}
+
+/*
+ * Release locks on all partitions.
+ */
+static void
+release_all_partitions(void)
+{
+	int			part;
+
+	for (part = num_partitions - 1 ; part >= 0 ; part--)
+		LWLockRelease(PARTITION_LOCK(part));
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * Set up parameters of the dynamic hash table.
+ */
+static void
+dsh_params(dshash_parameters *params)
+{
+	params->key_size = sizeof(pgspHashKey);
+	params->entry_size = sizeof(pgspEntry);
+	if (plan_storage == PLAN_STORAGE_SHMEM)
+		params->entry_size += max_plan_len;
+	params->compare_function = dshash_memcmp;
+	params->hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+	params->copy_function = dshash_memcpy;
+#endif
+	params->tranche_id = shared_state->dsh_tranche;
+}
+
+/*
+ * Create the DSA area placed in the main shared memory, and the dynamic hash
+ * table in it if enabled.  Called in the postmaster.
+ */
+static void
+dsh_create(void)
+{
+	dsa_area   *area;
+	dshash_table *table;
+	dshash_parameters params;
+
+	area = dsa_create_in_place(dsa_place, PGSP_DSA_INITIAL_SIZE,
+							   shared_state->dsa_tranche, NULL);
+	dsa_pin(area);
+
+	if (!dynamic_table)
+	{
+		dsa_detach(area);
+		return;
+	}
+
+	/*
+	 * The postmaster cannot create DSM segments.  Limit the area to the
+	 * initial size so that the table is created in place.
+	 */
+	dsa_set_size_limit(area, PGSP_DSA_INITIAL_SIZE);
+
+	dsh_params(&params);
+	table = dshash_create(area, &params, NULL);
+	shared_state->dsh_handle = dshash_get_hash_table_handle(table);
+
+	dsa_set_size_limit(area, -1);
+
+	dshash_detach(table);
+	dsa_detach(area);
+}
+
+/*
+ * Attach to the DSA area, if not yet.
+ */
+static void
+dsh_attach_area(void)
+{
+	MemoryContext oldcontext;
+
+	if (dsh_area)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	dsh_area = dsa_attach_in_place(dsa_place, NULL);
+	dsa_pin_mapping(dsh_area);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Attach to the dynamic hash table, if not yet.
+ */
+static void
+dsh_attach(void)
+{
+	MemoryContext oldcontext;
+	dshash_parameters params;
+
+	if (dsh_table)
+		return;
+
+	dsh_attach_area();
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	dsh_params(&params);
+	dsh_table = dshash_attach(dsh_area, &params, shared_state->dsh_handle,
+							  NULL);
+
+	MemoryContextSwitchTo(oldcontext);
+}
+#endif
+
+/*
+ * Find the entry for the key.
+ * Caller must hold at least a shared lock on the partition of the key.
+ */
+static pgspEntry *
+entry_find(int part, pgspHashKey *key)
+{
+#if PG_VERSION_NUM >= 150000
+	if (dynamic_table)
+	{
+		pgspEntry  *entry;
+
+		dsh_attach();
+		entry = (pgspEntry *) dshash_find(dsh_table, key, false);
+
+		/*
+		 * Entries never move in DSA and are removed only with exclusive lock
+		 * on the partition, so we don't need the lock of dshash any longer.
+		 */
+		if (entry)
+			dshash_release_lock(dsh_table, entry);
+
+		return entry;
+	}
+#endif
+
+	return (pgspEntry *) hash_search(hash_tables[part], key, HASH_FIND, NULL);
+}
+
+/*
+ * Find or create the entry for the key.  Only the key of a new entry is
+ * initialized.
+ * Caller must hold an exclusive lock on the partition of the key.
+ */
+static pgspEntry *
+entry_enter(int part, pgspHashKey *key, bool *found)
+{
+#if PG_VERSION_NUM >= 150000
+	if (dynamic_table)
+	{
+		pgspEntry  *entry;
+
+		dsh_attach();
+		entry = (pgspEntry *) dshash_find_or_insert(dsh_table, key, found);
+		dshash_release_lock(dsh_table, entry);
+
+		if (!*found)
+			shared_state->num_entries++;
+
+		return entry;
+	}
+#endif
+
+	return (pgspEntry *) hash_search(hash_tables[part], key, HASH_ENTER, found);
+}
+
+/*
+ * Remove the entry for the key.
+ * Caller must hold an exclusive lock on the partition of the key.
+ */
+static void
+entry_remove(int part, pgspHashKey *key)
+{
+#if PG_VERSION_NUM >= 150000
+	if (dynamic_table)
+	{
+		dsh_attach();
+		if (dshash_delete_key(dsh_table, key))
+			shared_state->num_entries--;
+
+		return;
+	}
+#endif
+
+	hash_search(hash_tables[part], key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Return the number of entries in a partition.
+ * Caller must hold at least a shared lock on the partition.
+ */
+static long
+partition_num_entries(int part)
+{
+	if (dynamic_table)
+		return shared_state->num_entries;
+
+	return hash_get_num_entries(hash_tables[part]);
+}
+
+/*
+ * Start a scan over the entries of a partition.  The scan must be exclusive
+ * to remove entries during the scan.
+ * Caller must hold a lock on the partition, which must be exclusive to
+ * remove entries.
+ */
+static void
+entry_scan_init(pgspEntryScan *scan, int part, bool exclusive)
+{
+#if PG_VERSION_NUM >= 150000
+	if (dynamic_table)
+	{
+		dsh_attach();
+		dshash_seq_init(&scan->dsh_seq, dsh_table, exclusive);
+		scan->dsh_active = true;
+		return;
+	}
+#endif
+
+	scan->htab = hash_tables[part];
+	hash_seq_init(&scan->hash_seq, scan->htab);
+}
+
+/*
+ * Return the next entry of a scan, or NULL when the scan has ended.
+ */
+static pgspEntry *
+entry_scan_next(pgspEntryScan *scan)
+{
+#if PG_VERSION_NUM >= 150000
+	if (dynamic_table)
+	{
+		pgspEntry  *entry = (pgspEntry *) dshash_seq_next(&scan->dsh_seq);
+
+		if (entry == NULL)
+			entry_scan_term(scan);
+
+		return entry;
+	}
+#endif
+
+	return (pgspEntry *) hash_seq_search(&scan->hash_seq);
+}
+
+/*
+ * Terminate a scan before it reaches the end.
+ */
+static void
+entry_scan_term(pgspEntryScan *scan)
+{
+#if PG_VERSION_NUM >= 150000
+	if (dynamic_table)
+	{
+		if (scan->dsh_active)
+			dshash_seq_term(&scan->dsh_seq);
+		scan->dsh_active = false;
+		return;
+	}
+#endif
+
+	hash_seq_term(&scan->hash_seq);
+}
 
-	size = add_size(size, hash_estimate_size(store_size, entry_size));
+/*
+ * Remove the entry just returned by an exclusive scan.
+ */
+static void
+entry_scan_remove(pgspEntryScan *scan, pgspEntry *entry)
+{
+#if PG_VERSION_NUM >= 150000
+	if (dynamic_table)
+	{
+		dshash_delete_current(&scan->dsh_seq);
+		shared_state->num_entries--;
+		return;
+	}
+#endif
 
-	return size;
+	hash_search(scan->htab, &entry->key, HASH_REMOVE, NULL);
 }
 
 /*
  * Allocate a new hashtable entry.
- * caller must hold an exclusive lock on shared_state->lock
+ * caller must hold an exclusive lock on the partition of the key
  *
  * "plan" need not be null-terminated; we rely on plan_len instead
  *
@@ -1772,17 +4152,20 @@ shared_mem_size(void)
  * have made the entry while we waited to get exclusive lock.
  */
 static pgspEntry *
-entry_alloc(pgspHashKey *key, Size plan_offset, int plan_len, bool sticky)
+entry_alloc(pgspHashKey *key, Size plan_offset, int plan_len,
+			uint32 plan_check, bool sticky)
 {
 	pgspEntry  *entry;
 	bool		found;
+	int			part = entry_partition(key);
 
 	/* Make space if needed */
-	while (hash_get_num_entries(hash_table) >= store_size)
-		entry_dealloc();
+	while (partition_num_entries(part) >=
+		   (dynamic_table ? store_size : partition_size))
+		entry_dealloc(part);
 
 	/* Find or create an entry with desired hash code */
-	entry = (pgspEntry *) hash_search(hash_table, key, HASH_ENTER, &found);
+	entry = entry_enter(part, key, &found);
 
 	if (!found)
 	{
@@ -1790,6 +4173,7 @@ entry_alloc(pgspHashKey *key, Size plan_offset, int plan_len, bool sticky)
 
 		/* reset the statistics */
 		memset(&entry->counters, 0, sizeof(Counters));
+		atomic_counters_init(&entry->acounters, &entry->counters);
 		/* set the appropriate initial usage count */
 		entry->counters.usage = sticky ? shared_state->cur_median_usage : USAGE_INIT;
 		/* re-initialize the mutex each time ... we assume no one using it */
@@ -1799,6 +4183,12 @@ entry_alloc(pgspHashKey *key, Size plan_offset, int plan_len, bool sticky)
 		entry->plan_offset = plan_offset;
 		entry->plan_len = plan_len;
 		entry->encoding = GetDatabaseEncoding();
+		entry->plan_check = plan_check;
+		entry->text_shared = false;
+
+		/* Share the plan text with other entries of the same plan */
+		if (plan_storage == PLAN_STORAGE_FILE)
+			ptext_ref(entry);
 	}
 
 	return entry;
@@ -1822,13 +4212,13 @@ entry_cmp(const void *lhs, const void *rhs)
 }
 
 /*
- * Deallocate least used entries.
- * Caller must hold an exclusive lock on shared_state->lock.
+ * Deallocate least used entries in a partition.
+ * Caller must hold an exclusive lock on the partition.
  */
 static void
-entry_dealloc(void)
+entry_dealloc(int part)
 {
-	HASH_SEQ_STATUS hash_seq;
+	pgspEntryScan scan;
 	pgspEntry **entries;
 	pgspEntry  *entry;
 	int			nvictims;
@@ -1842,14 +4232,14 @@ entry_dealloc(void)
 	 * values.
 	 */
 
-	entries = palloc(hash_get_num_entries(hash_table) * sizeof(pgspEntry *));
+	entries = palloc(partition_num_entries(part) * sizeof(pgspEntry *));
 
 	i = 0;
 	tottextlen = 0;
 	nvalidtexts = 0;
 
-	hash_seq_init(&hash_seq, hash_table);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	entry_scan_init(&scan, part, false);
+	while ((entry = entry_scan_next(&scan)) != NULL)
 	{
 		entries[i++] = entry;
 		/* "Sticky" entries get a different usage decay rate. */
@@ -1868,21 +4258,31 @@ entry_dealloc(void)
 
 	qsort(entries, i, sizeof(pgspEntry *), entry_cmp);
 
-	/* Also, record the (approximate) median usage */
-	if (i > 0)
-		shared_state->cur_median_usage = entries[i / 2]->counters.usage;
-	/* Record the mean plan length */
-	if (nvalidtexts > 0)
-		shared_state->mean_plan_len = tottextlen / nvalidtexts;
-	else
-		shared_state->mean_plan_len = ASSUMED_LENGTH_INIT;
+	/*
+	 * Also, record the (approximate) median usage and the mean plan length,
+	 * estimated from this partition.  Deallocation may be running on other
+	 * partitions concurrently, so take the mutex.
+	 */
+	{
+		volatile pgspSharedState *s = (volatile pgspSharedState *) shared_state;
+
+		SpinLockAcquire(&s->mutex);
+		if (i > 0)
+			s->cur_median_usage = entries[i / 2]->counters.usage;
+		if (nvalidtexts > 0)
+			s->mean_plan_len = tottextlen / nvalidtexts;
+		else
+			s->mean_plan_len = ASSUMED_LENGTH_INIT;
+		SpinLockRelease(&s->mutex);
+	}
 
 	nvictims = Max(10, i * USAGE_DEALLOC_PERCENT / 100);
 	nvictims = Min(nvictims, i);
 
 	for (i = 0; i < nvictims; i++)
 	{
-		hash_search(hash_table, &entries[i]->key, HASH_REMOVE, NULL);
+		ptext_release(entries[i]);
+		entry_remove(part, &entries[i]->key);
 	}
 
 	pfree(entries);
@@ -1897,6 +4297,189 @@ entry_dealloc(void)
 	}
 }
 
+/*
+ * Deallocate entries until the number of entries fits pg_store_plans.max,
+ * which may have been reduced for the dynamic hash table.
+ */
+static void
+entry_trim(void)
+{
+	int			part;
+
+	for (part = 0 ; part < num_partitions ; part++)
+	{
+		LWLockAcquire(PARTITION_LOCK(part), LW_EXCLUSIVE);
+		while (partition_num_entries(part) >
+			   (dynamic_table ? store_size : partition_size))
+			entry_dealloc(part);
+		LWLockRelease(PARTITION_LOCK(part));
+	}
+}
+
+/*
+ * Make the form of a plan text to store, compressed as
+ * pg_store_plans.plan_compression says.
+ *
+ * *plan_len is the length of plan on entry, and is set to the length of the
+ * result, which is shorter than plan_size.  The whole plan is compressed if it
+ * fits, otherwise the plan clipped to plan_size is stored.  Returns plan
+ * itself if it is not compressed, or a palloc'd buffer.  The result is not
+ * terminated by NUL.
+ */
+static char *
+plan_compress(char *plan, int *plan_len, int encoding)
+{
+	int			len = *plan_len;
+	int			cliplen = len;
+	int			plan_size = shared_state->plan_size;
+
+	if (cliplen >= plan_size)
+		cliplen = pg_encoding_mbcliplen(encoding, plan, len, plan_size - 1);
+
+	if (plan_compression != PLAN_COMPRESSION_NONE &&
+		len >= PLAN_COMPRESS_MIN_LEN)
+	{
+		char	   *buf;
+		int			bound = PGLZ_MAX_OUTPUT(len);
+		int			clen;
+
+#ifdef USE_LZ4
+		bound = Max(bound, LZ4_compressBound(len));
+#endif
+		buf = palloc(PLAN_COMPRESSED_HDRSZ + bound);
+
+		clen = plan_compress_bytes(plan, len, buf);
+
+		/* Try the clipped plan if the whole one doesn't fit */
+		if (clen >= plan_size)
+			clen = -1;
+		if (clen < 0 && cliplen < len)
+			clen = plan_compress_bytes(plan, cliplen, buf);
+
+		if (clen >= 0)
+		{
+			*plan_len = clen;
+			return buf;
+		}
+
+		pfree(buf);
+	}
+
+	*plan_len = cliplen;
+	return plan;
+}
+
+/*
+ * Compress plan_len bytes of plan into dest with the current method.
+ *
+ * Returns the length of the compressed form including the header, or -1 if it
+ * would not be shorter than the plan.
+ */
+static int
+plan_compress_bytes(const char *plan, int plan_len, char *dest)
+{
+	int32		rawlen = plan_len;
+	int32		clen = -1;
+
+	switch (plan_compression)
+	{
+		case PLAN_COMPRESSION_PGLZ:
+			dest[0] = PLAN_COMPRESSED_PGLZ;
+			clen = pglz_compress(plan, plan_len, dest + PLAN_COMPRESSED_HDRSZ,
+								 PGLZ_strategy_default);
+			break;
+#ifdef USE_LZ4
+		case PLAN_COMPRESSION_LZ4:
+			dest[0] = PLAN_COMPRESSED_LZ4;
+			clen = LZ4_compress_default(plan, dest + PLAN_COMPRESSED_HDRSZ,
+										plan_len, LZ4_compressBound(plan_len));
+			if (clen <= 0)
+				clen = -1;
+			break;
+#endif
+		default:
+			break;
+	}
+
+	if (clen < 0 || clen + PLAN_COMPRESSED_HDRSZ >= plan_len)
+		return -1;
+
+	memcpy(dest + 1, &rawlen, sizeof(int32));
+
+	return clen + PLAN_COMPRESSED_HDRSZ;
+}
+
+/*
+ * Return the original form of a stored plan text of plan_len bytes.
+ *
+ * A compressed plan is decompressed into a palloc'd buffer terminated by NUL,
+ * otherwise plan itself is returned.  Returns NULL if plan is NULL or the
+ * compressed data is broken.
+ */
+static char *
+plan_decompress(char *plan, int plan_len)
+{
+	int32		rawlen;
+	int32		ret = -1;
+	char	   *raw;
+
+	if (plan == NULL || plan_len < PLAN_COMPRESSED_HDRSZ ||
+		(plan[0] != PLAN_COMPRESSED_PGLZ && plan[0] != PLAN_COMPRESSED_LZ4))
+		return plan;
+
+	memcpy(&rawlen, plan + 1, sizeof(int32));
+	if (rawlen <= 0 || rawlen >= MaxAllocSize)
+		return NULL;
+
+	raw = palloc(rawlen + 1);
+
+	if (plan[0] == PLAN_COMPRESSED_PGLZ)
+		ret = pglz_decompress(plan + PLAN_COMPRESSED_HDRSZ,
+							  plan_len - PLAN_COMPRESSED_HDRSZ,
+							  raw, rawlen
+#if PG_VERSION_NUM >= 120000
+							  , true
+#endif
+			);
+#ifdef USE_LZ4
+	else
+		ret = LZ4_decompress_safe(plan + PLAN_COMPRESSED_HDRSZ, raw,
+								  plan_len - PLAN_COMPRESSED_HDRSZ, rawlen);
+#endif
+
+	/* The server may lack LZ4 that another incarnation had */
+	if (ret != rawlen)
+	{
+		pfree(raw);
+		return NULL;
+	}
+
+	raw[rawlen] = '\0';
+	return raw;
+}
+
+/*
+ * Returns true if a background garbage collection is running and
+ * plan_offset is below its boundary.  The caller has to store the text again
+ * before a new entry or a shared text refers to it, since the gc may have
+ * copied the partition of the entry and the shared texts already.
+ *
+ * Caller must hold an exclusive lock on the partition to be referring the
+ * text, so that the gc cannot have got past the swap of the files.
+ */
+static bool
+ptext_behind_gc(Size plan_offset)
+{
+	volatile pgspSharedState *s = (volatile pgspSharedState *) shared_state;
+	bool		behind;
+
+	SpinLockAcquire(&s->mutex);
+	behind = (s->gc_running && plan_offset < s->gc_boundary);
+	SpinLockRelease(&s->mutex);
+
+	return behind;
+}
+
 /*
  * Given a plan string (not necessarily null-terminated), allocate a new
  * entry in the external plan text file and store the string there.
@@ -1907,8 +4490,12 @@ entry_dealloc(void)
  *
  * On failure, returns false.
  *
- * At least a shared lock on shared_state->lock must be held by the caller, so
- * as to prevent a concurrent garbage collection.  Share-lock-holding callers
+ * When plan writer is enabled, the plan text is just queued to be written out
+ * later unless the queue is full.  Readers of the file must call ptext_flush()
+ * beforehand.
+ *
+ * At least a shared lock on a partition must be held by the caller, so as to
+ * prevent a concurrent garbage collection.  Share-lock-holding callers
  * should pass a gc_count pointer to obtain the number of garbage collections,
  * so that they can recheck the count after obtaining exclusive lock to detect
  * whether a garbage collection occurred (and removed this entry).
@@ -1939,6 +4526,13 @@ ptext_store(const char *plan, int plan_len, Size *plan_offset, int *gc_count)
 
 	*plan_offset = off;
 
+	/*
+	 * Leave the write to plan writer if possible. The queued plan counts as a
+	 * writer until it is written out.
+	 */
+	if (PLAN_WRITER_ENABLED() && ptext_enqueue(plan, plan_len, off))
+		return true;
+
 	/* Now write the data into the successfully-reserved part of the file */
 	fd = OpenTransientFile(PGSP_TEXT_FILE, O_RDWR | O_CREAT | PG_BINARY);
 	if (fd < 0)
@@ -1949,38 +4543,325 @@ ptext_store(const char *plan, int plan_len, Size *plan_offset, int *gc_count)
 	if (pg_pwrite(fd, "\0", 1, off + plan_len) != 1)
 		goto error;
 
-	CloseTransientFile(fd);
+	CloseTransientFile(fd);
+
+	/* Mark our write complete */
+	{
+		volatile pgspSharedState *s = (volatile pgspSharedState *) shared_state;
+
+		SpinLockAcquire(&s->mutex);
+		s->n_writers--;
+		SpinLockRelease(&s->mutex);
+	}
+
+	return true;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m",
+					PGSP_TEXT_FILE)));
+
+	if (fd >= 0)
+		CloseTransientFile(fd);
+
+	/* Mark our write complete */
+	{
+		volatile pgspSharedState *s = (volatile pgspSharedState *) shared_state;
+
+		SpinLockAcquire(&s->mutex);
+		s->n_writers--;
+		SpinLockRelease(&s->mutex);
+	}
+
+	return false;
+}
+
+/*
+ * Queue a plan text to be written at plan_offset by plan writer.
+ *
+ * Returns false if the queue doesn't have room for the plan.
+ */
+static bool
+ptext_enqueue(const char *plan, int plan_len, Size plan_offset)
+{
+	Size		size = QUEUED_PLAN_SIZE(plan_len);
+	Size		queue_size = (Size) writer_queue_size * 1024;
+	pgspQueuedPlan *qplan;
+	Latch	   *latch;
+	bool		wakeup;
+
+	LWLockAcquire(shared_state->queue_lock, LW_EXCLUSIVE);
+
+	if (shared_state->queue_len + size > queue_size)
+	{
+		LWLockRelease(shared_state->queue_lock);
+		return false;
+	}
+
+	qplan = (pgspQueuedPlan *) (plan_queue + shared_state->queue_len);
+	qplan->plan_offset = plan_offset;
+	qplan->plan_len = plan_len;
+	memcpy((char *) qplan + sizeof(pgspQueuedPlan), plan, plan_len);
+	((char *) qplan)[sizeof(pgspQueuedPlan) + plan_len] = '\0';
+	shared_state->queue_len += size;
+
+	/* Wake up plan writer early when the queue is getting full */
+	wakeup = (shared_state->queue_len >= queue_size / 2);
+	latch = shared_state->writer_latch;
+
+	LWLockRelease(shared_state->queue_lock);
+
+	if (wakeup && latch)
+		SetLatch(latch);
+
+	return true;
+}
+
+/*
+ * Write out all queued plan texts, waiting for plan writer if it is
+ * writing.
+ *
+ * This must be called before reading the plan text file while holding at
+ * least a shared lock on the partitions to read, so that all entries there
+ * have their plan texts in the file.
+ */
+static void
+ptext_flush(void)
+{
+	if (!PLAN_WRITER_ENABLED() || plan_queue == NULL)
+		return;
+
+	LWLockAcquire(shared_state->flush_lock, LW_EXCLUSIVE);
+	ptext_write_queue(true);
+	LWLockRelease(shared_state->flush_lock);
+}
+
+/*
+ * Take all queued plan texts and write them into the plan text file.
+ *
+ * Plan texts reserved at consecutive offsets are merged so that they are
+ * written by a single write. If lock is false, the caller is responsible for
+ * ensuring that no one else is touching the queue.
+ */
+static void
+ptext_write_queue(bool lock)
+{
+	char	   *buf = NULL;
+	Size		len;
+	Size		pos;
+	int			nplans = 0;
+	int			fd;
+	bool		failed = false;
+	char	   *run = NULL;		/* start of the current run in buf */
+	Size		run_offset = 0;	/* file offset of the current run */
+	Size		run_len = 0;	/* # of bytes in the current run */
+
+	/* Take the queued plans, so that backends can queue more meanwhile */
+	if (lock)
+		LWLockAcquire(shared_state->queue_lock, LW_EXCLUSIVE);
+	len = shared_state->queue_len;
+	if (len > 0)
+	{
+		buf = palloc(len);
+		memcpy(buf, plan_queue, len);
+		shared_state->queue_len = 0;
+	}
+	if (lock)
+		LWLockRelease(shared_state->queue_lock);
+
+	if (len == 0)
+		return;
+
+	fd = OpenTransientFile(PGSP_TEXT_FILE, O_RDWR | O_CREAT | PG_BINARY);
+	if (fd < 0)
+		failed = true;
+
+	/*
+	 * Move the plan texts of a run together over the headers in buf. Fields
+	 * of a plan are read out beforehand since they may be overwritten.
+	 */
+	for (pos = 0 ; pos < len ; nplans++)
+	{
+		pgspQueuedPlan *qplan = (pgspQueuedPlan *) (buf + pos);
+		Size		plan_offset = qplan->plan_offset;
+		Size		plan_len = qplan->plan_len + 1;
+		char	   *plan = buf + pos + sizeof(pgspQueuedPlan);
+
+		pos += QUEUED_PLAN_SIZE(qplan->plan_len);
+
+		if (failed)
+			continue;
+
+		if (run && plan_offset == run_offset + run_len)
+		{
+			memmove(run + run_len, plan, plan_len);
+			run_len += plan_len;
+			continue;
+		}
+
+		if (run && pg_pwrite(fd, run, run_len, run_offset) != run_len)
+		{
+			failed = true;
+			continue;
+		}
+
+		run = plan;
+		run_offset = plan_offset;
+		run_len = plan_len;
+	}
+
+	if (!failed && run && pg_pwrite(fd, run, run_len, run_offset) != run_len)
+		failed = true;
+
+	if (failed)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m",
+						PGSP_TEXT_FILE)));
+
+	if (fd >= 0)
+		CloseTransientFile(fd);
+
+	pfree(buf);
+
+	/* Mark the writes of the queued plans complete */
+	{
+		volatile pgspSharedState *s = (volatile pgspSharedState *) shared_state;
+
+		SpinLockAcquire(&s->mutex);
+		s->n_writers -= nplans;
+		SpinLockRelease(&s->mutex);
+	}
+}
+
+/*
+ * Signal handler for SIGHUP of plan writer
+ */
+static void
+pgsp_writer_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Signal handler for SIGTERM of plan writer
+ */
+static void
+pgsp_writer_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Detach plan writer from shared state
+ */
+static void
+pgsp_writer_exit(int code, Datum arg)
+{
+	LWLockAcquire(shared_state->queue_lock, LW_EXCLUSIVE);
+	shared_state->writer_latch = NULL;
+	LWLockRelease(shared_state->queue_lock);
+}
+
+/*
+ * Main entry of plan writer, which writes out queued plan texts every
+ * pg_store_plans.writer_delay milliseconds or when the queue is getting full.
+ *
+ * With pg_store_plans.background_gc, plan writer also garbage-collects the
+ * plan text file.  When entries live in DSA, plan writer also loads the saved
+ * entries at the first start and saves them at exit.  It trims the dynamic
+ * hash table when pg_store_plans.max is reduced.
+ */
+void
+pgsp_writer_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, pgsp_writer_sighup);
+	pqsignal(SIGTERM, pgsp_writer_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	/* Safety check... */
+	if (!shared_state || (!plan_queue && !ENTRIES_IN_DSA()))
+		proc_exit(0);
+
+	if (plan_queue)
+	{
+		LWLockAcquire(shared_state->queue_lock, LW_EXCLUSIVE);
+		shared_state->writer_latch = MyLatch;
+		LWLockRelease(shared_state->queue_lock);
+		before_shmem_exit(pgsp_writer_exit, (Datum) 0);
+	}
+
+#if PG_VERSION_NUM >= 150000
+	if (ENTRIES_IN_DSA())
+	{
+		lock_all_partitions(LW_EXCLUSIVE);
+
+		/*
+		 * Load the saved entries only once.  A dump file written by a former
+		 * plan writer at its exit is no longer valid.
+		 */
+		if (!shared_state->dsh_loaded)
+		{
+			shared_state->dsh_loaded = true;
+			if (dump_on_shutdown)
+				entries_load(NULL);
+		}
+		else
+			unlink(PGSP_DUMP_FILE);
+
+		release_all_partitions();
+	}
+#endif
 
-	/* Mark our write complete */
+	while (!got_sigterm)
 	{
-		volatile pgspSharedState *s = (volatile pgspSharedState *) shared_state;
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 writer_delay, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
 
-		SpinLockAcquire(&s->mutex);
-		s->n_writers--;
-		SpinLockRelease(&s->mutex);
-	}
+		CHECK_FOR_INTERRUPTS();
 
-	return true;
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
 
-error:
-	ereport(LOG,
-			(errcode_for_file_access(),
-			 errmsg("could not write file \"%s\": %m",
-					PGSP_TEXT_FILE)));
+			if (dynamic_table)
+				entry_trim();
+		}
 
-	if (fd >= 0)
-		CloseTransientFile(fd);
+		ptext_flush();
 
-	/* Mark our write complete */
-	{
-		volatile pgspSharedState *s = (volatile pgspSharedState *) shared_state;
+		/* Compact the plan text file on behalf of backends */
+		if (background_gc && PLAN_WRITER_ENABLED() && need_gc_ptexts())
+			gc_ptexts_background();
+	}
 
-		SpinLockAcquire(&s->mutex);
-		s->n_writers--;
-		SpinLockRelease(&s->mutex);
+	/*
+	 * Save the entries in DSA, which the postmaster cannot do at shutdown.
+	 * Backends may still be running here.
+	 */
+	if (ENTRIES_IN_DSA() && dump_on_shutdown)
+	{
+		lock_all_partitions(LW_SHARED);
+		ptext_flush();
+		(void) entries_dump();
+		release_all_partitions();
 	}
 
-	return false;
+	proc_exit(1);
 }
 
 /*
@@ -1991,8 +4872,8 @@ error:
  *
  * On success, the buffer size is also returned into *buffer_size.
  *
- * This can be called without any lock on shared_state->lock, but in that case
- * the caller is responsible for verifying that the result is sane.
+ * This can be called without any partition lock, but in that case the caller
+ * is responsible for verifying that the result is sane.
  */
 static char *
 ptext_load_file(Size *buffer_size)
@@ -2084,7 +4965,96 @@ ptext_load_file(Size *buffer_size)
 }
 
 /*
- * Locate a plan text in the file image previously read by ptext_load_file().
+ * Map the external plan text file into memory read-only.
+ *
+ * Returns NULL (without throwing an error) if unable to map, eg file not
+ * there or empty.  On success, the mapping size is also returned into
+ * *buffer_size, and the caller must release the mapping with
+ * ptext_unmap_file().
+ *
+ * Unlike ptext_load_file() this doesn't copy the file, so concurrent readers
+ * share the pages through the kernel page cache, and only the pages actually
+ * touched are read.  The flip side is that the mapped image follows the file:
+ * texts appended later beyond the mapped size are merely invisible, but
+ * accessing the mapping after the file has been truncated raises SIGBUS.
+ * Thus the caller must hold a partition lock while reading through the
+ * mapping and must remap it once shared_state->gc_count has changed, since
+ * only garbage collection and reset rewrite or truncate the file.
+ */
+static char *
+ptext_map_file(Size *buffer_size)
+{
+	char	   *buf;
+	int			fd;
+	struct stat stat;
+
+	Assert (plan_storage == PLAN_STORAGE_FILE);
+
+	fd = OpenTransientFile(PGSP_TEXT_FILE, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m",
+							PGSP_TEXT_FILE)));
+		return NULL;
+	}
+
+	/* Get file length */
+	if (fstat(fd, &stat))
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m",
+						PGSP_TEXT_FILE)));
+		CloseTransientFile(fd);
+		return NULL;
+	}
+
+	/* mmap() refuses zero length; beware that off_t might be wider too */
+	if (stat.st_size == 0 || stat.st_size > MaxAllocHugeSize)
+	{
+		CloseTransientFile(fd);
+		return NULL;
+	}
+
+	buf = mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not map file \"%s\": %m",
+						PGSP_TEXT_FILE)));
+		CloseTransientFile(fd);
+		return NULL;
+	}
+
+	/* The mapping stays valid after the descriptor is closed */
+	if (CloseTransientFile(fd) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", PGSP_TEXT_FILE)));
+
+	*buffer_size = stat.st_size;
+	return buf;
+}
+
+/*
+ * Release a mapping made by ptext_map_file().
+ */
+static void
+ptext_unmap_file(char *buffer, Size buffer_size)
+{
+	if (munmap(buffer, buffer_size) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not unmap file \"%s\": %m", PGSP_TEXT_FILE)));
+}
+
+/*
+ * Locate a plan text in the file image previously read by ptext_load_file()
+ * or mapped by ptext_map_file().
  *
  * We validate the given offset/length, and return NULL if bogus.  Otherwise,
  * the result points to a null-terminated string within the buffer.
@@ -2109,15 +5079,317 @@ ptext_fetch(Size plan_offset, int plan_len,
 	return buffer + plan_offset;
 }
 
+/*
+ * Set up the key of the shared plan text for an entry.
+ */
+static void
+ptext_make_key(pgspTextKey *tkey, pgspHashKey *key, int encoding)
+{
+	memset(tkey, 0, sizeof(pgspTextKey));
+	tkey->queryid = key->queryid;
+	tkey->planid = key->planid;
+	tkey->encoding = encoding;
+}
+
+/*
+ * Look up the shared plan text of the plan of the key.
+ *
+ * Returns true and sets *plan_offset and *plan_len if found.  The caller must
+ * hold at least a shared lock on a partition, and must recheck gc_count after
+ * obtaining exclusive lock as it does for ptext_store().
+ */
+static bool
+ptext_lookup(pgspHashKey *key, Size *plan_offset, int *plan_len)
+{
+	pgspTextKey	tkey;
+	pgspPlanText *text;
+	bool		found = false;
+
+	if (text_table == NULL)
+		return false;
+
+	ptext_make_key(&tkey, key, GetDatabaseEncoding());
+
+	LWLockAcquire(shared_state->text_lock, LW_SHARED);
+	text = (pgspPlanText *) hash_search(text_table, &tkey, HASH_FIND, NULL);
+	if (text && text->plan_len >= 0)
+	{
+		*plan_offset = text->plan_offset;
+		*plan_len = text->plan_len;
+		found = true;
+	}
+	LWLockRelease(shared_state->text_lock);
+
+	return found;
+}
+
+/*
+ * Make a new entry reference the shared plan text of its plan.  The entry
+ * switches to the shared text if any, otherwise the text of the entry becomes
+ * the shared one.  The entry keeps its own text if the table is full.
+ *
+ * Caller must hold an exclusive lock on the partition of the entry.
+ */
+static void
+ptext_ref(pgspEntry *entry)
+{
+	pgspTextKey	tkey;
+	pgspPlanText *text;
+
+	Assert(!entry->text_shared);
+
+	if (text_table == NULL)
+		return;
+
+	ptext_make_key(&tkey, &entry->key, entry->encoding);
+
+	LWLockAcquire(shared_state->text_lock, LW_EXCLUSIVE);
+
+	text = (pgspPlanText *) hash_search(text_table, &tkey, HASH_FIND, NULL);
+	if (text == NULL)
+	{
+		/*
+		 * The table is sized by pg_store_plans.max at server start, which
+		 * the dynamic table may have outgrown since then.  Entries beyond
+		 * that just keep their own texts.
+		 */
+		if (hash_get_num_entries(text_table) < shared_state->text_table_size)
+			text = (pgspPlanText *) hash_search(text_table, &tkey,
+												HASH_ENTER_NULL, NULL);
+		if (text)
+		{
+			text->plan_offset = entry->plan_offset;
+			text->plan_len = entry->plan_len;
+			text->refcount = 0;
+			text->gc_count = -1;
+		}
+	}
+	else if (text->plan_len < 0)
+	{
+		/* The shared text has been dropped by gc, replace it */
+		text->plan_offset = entry->plan_offset;
+		text->plan_len = entry->plan_len;
+	}
+	else
+	{
+		entry->plan_offset = text->plan_offset;
+		entry->plan_len = text->plan_len;
+	}
+
+	if (text)
+	{
+		text->refcount++;
+		entry->text_shared = true;
+	}
+
+	LWLockRelease(shared_state->text_lock);
+}
+
+/*
+ * Drop the reference of an entry to be removed to its shared plan text.  The
+ * text is forgotten when no entry references it, and left in the file to
+ * garbage collection.
+ *
+ * Caller must hold an exclusive lock on the partition of the entry.
+ */
+static void
+ptext_unref(pgspEntry *entry)
+{
+	pgspTextKey	tkey;
+	pgspPlanText *text;
+
+	if (!entry->text_shared)
+		return;
+
+	ptext_make_key(&tkey, &entry->key, entry->encoding);
+
+	LWLockAcquire(shared_state->text_lock, LW_EXCLUSIVE);
+	text = (pgspPlanText *) hash_search(text_table, &tkey, HASH_FIND, NULL);
+	if (text && --text->refcount <= 0)
+		hash_search(text_table, &tkey, HASH_REMOVE, NULL);
+	LWLockRelease(shared_state->text_lock);
+
+	entry->text_shared = false;
+}
+
+/*
+ * Make the shared plan text of an entry be the new text of the entry.  The
+ * other entries referencing it are moved to the new text at the next garbage
+ * collection.
+ *
+ * Caller must hold an exclusive lock on the partition of the entry.
+ */
+static void
+ptext_update(pgspEntry *entry)
+{
+	pgspTextKey	tkey;
+	pgspPlanText *text;
+
+	if (!entry->text_shared)
+		return;
+
+	ptext_make_key(&tkey, &entry->key, entry->encoding);
+
+	LWLockAcquire(shared_state->text_lock, LW_EXCLUSIVE);
+	text = (pgspPlanText *) hash_search(text_table, &tkey, HASH_FIND, NULL);
+	if (text)
+	{
+		text->plan_offset = entry->plan_offset;
+		text->plan_len = entry->plan_len;
+	}
+	LWLockRelease(shared_state->text_lock);
+}
+
+/*
+ * Forget all shared plan texts.
+ *
+ * The caller must hold exclusive locks on all partitions, which keeps
+ * everyone else off the table.
+ */
+static void
+ptext_forget_all(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgspPlanText *text;
+
+	if (text_table == NULL)
+		return;
+
+	hash_seq_init(&hash_seq, text_table);
+	while ((text = (pgspPlanText *) hash_seq_search(&hash_seq)) != NULL)
+		hash_search(text_table, &text->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Release the plan text of an entry to be removed.
+ *
+ * Caller must hold an exclusive lock on the partition of the entry.
+ */
+static void
+ptext_release(pgspEntry *entry)
+{
+	if (plan_storage == PLAN_STORAGE_FILE)
+		ptext_unref(entry);
+	else if (plan_storage == PLAN_STORAGE_DSA)
+	{
+		ptext_dsa_free(entry->plan_offset);
+		entry->plan_offset = 0;
+		entry->plan_len = -1;
+	}
+}
+
+/*
+ * Copy a plan string (not necessarily null-terminated) into a chunk newly
+ * allocated in DSA, which is exactly sized for it.
+ *
+ * If successful, returns true, and stores the dsa_pointer to the chunk into
+ * *plan_offset.  On failure, returns false.
+ */
+static bool
+ptext_dsa_store(const char *plan, int plan_len, Size *plan_offset)
+{
+#if PG_VERSION_NUM >= 150000
+	dsa_pointer dp;
+	char	   *chunk;
+
+	Assert (plan_storage == PLAN_STORAGE_DSA);
+
+	dsh_attach_area();
+
+	dp = dsa_allocate_extended(dsh_area, plan_len + 1, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(dp))
+	{
+		ereport(LOG,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of shared memory"),
+				 errdetail("Could not allocate %d bytes for a plan text.",
+						   plan_len + 1)));
+		return false;
+	}
+
+	chunk = (char *) dsa_get_address(dsh_area, dp);
+	memcpy(chunk, plan, plan_len);
+	chunk[plan_len] = '\0';
+
+	*plan_offset = (Size) dp;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Locate a plan text stored by ptext_dsa_store().  Returns NULL if the text
+ * has been lost.
+ *
+ * The caller must hold a lock on the partition of the entry referencing it.
+ */
+static char *
+ptext_dsa_fetch(Size plan_offset, int plan_len)
+{
+#if PG_VERSION_NUM >= 150000
+	dsa_pointer dp = (dsa_pointer) plan_offset;
+
+	if (plan_len < 0 || !DsaPointerIsValid(dp))
+		return NULL;
+
+	dsh_attach_area();
+
+	return (char *) dsa_get_address(dsh_area, dp);
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Free a plan text stored by ptext_dsa_store().
+ *
+ * The caller must hold an exclusive lock on the partition of the entry that
+ * has referenced it.
+ */
+static void
+ptext_dsa_free(Size plan_offset)
+{
+#if PG_VERSION_NUM >= 150000
+	dsa_pointer dp = (dsa_pointer) plan_offset;
+
+	if (!DsaPointerIsValid(dp))
+		return;
+
+	dsh_attach_area();
+	dsa_free(dsh_area, dp);
+#endif
+}
+
+/*
+ * Return the stored plan text of an entry, or NULL if it is not available.
+ * pbuffer is the image of the plan text file loaded for the file storage.
+ */
+static char *
+entry_plan_text(pgspEntry *entry, char *pbuffer, Size pbuffer_size)
+{
+	switch (plan_storage)
+	{
+		case PLAN_STORAGE_FILE:
+			return ptext_fetch(entry->plan_offset, entry->plan_len,
+							   pbuffer, pbuffer_size);
+		case PLAN_STORAGE_DSA:
+			return ptext_dsa_fetch(entry->plan_offset, entry->plan_len);
+		default:
+			return SHMEM_PLAN_PTR(entry);
+	}
+}
+
 /*
  * Do we need to garbage-collect the external plan text file?
  *
- * Caller should hold at least a shared lock on shared_state->lock.
+ * Caller should hold at least a shared lock on a partition.
  */
 static bool
 need_gc_ptexts(void)
 {
 	Size		extent;
+	Size		mean_plan_len;
 
 	Assert (plan_storage == PLAN_STORAGE_FILE);
 
@@ -2127,10 +5399,16 @@ need_gc_ptexts(void)
 
 		SpinLockAcquire(&s->mutex);
 		extent = s->extent;
+		mean_plan_len = s->mean_plan_len;
 		SpinLockRelease(&s->mutex);
 	}
 
-	/* Don't proceed if file does not exceed 512 bytes per possible entry */
+	/*
+	 * Don't proceed if file does not exceed 512 bytes per possible entry.
+	 * This follows the current pg_store_plans.max even when the dynamic table
+	 * has outgrown the shared text table; the file then holds that many more
+	 * texts that cannot be shared.
+	 */
 	if (extent < 512 * store_size)
 		return false;
 
@@ -2141,7 +5419,7 @@ need_gc_ptexts(void)
 	 * query length in order to prevent garbage collection from thrashing
 	 * uselessly.
 	 */
-	if (extent < shared_state->mean_plan_len * store_size * 2)
+	if (extent < mean_plan_len * store_size * 2)
 		return false;
 
 	return true;
@@ -2157,7 +5435,7 @@ need_gc_ptexts(void)
  * becomes unreasonably large, with no other method of compaction likely to
  * occur in the foreseeable future.
  *
- * The caller must hold an exclusive lock on shared_state->lock.
+ * The caller must hold exclusive locks on all partitions.
  *
  * At the first sign of trouble we unlink the query text file to get a clean
  * slate (although existing statistics are retained), rather than risk
@@ -2169,10 +5447,14 @@ gc_ptexts(void)
 	char	   *pbuffer;
 	Size		pbuffer_size;
 	FILE	   *pfile = NULL;
-	HASH_SEQ_STATUS hash_seq;
+	pgspEntryScan scan;
 	pgspEntry  *entry;
+	HASH_SEQ_STATUS hash_seq;
+	pgspPlanText *text;
 	Size		extent;
 	int			nentries;
+	int			new_gc_count;
+	int			part;
 
 	Assert (plan_storage == PLAN_STORAGE_FILE);
 
@@ -2184,12 +5466,18 @@ gc_ptexts(void)
 	if (!need_gc_ptexts())
 		return;
 
+	/* All plan texts need to be in the file */
+	ptext_flush();
+
 	/*
 	 * Load the old texts file.  If we fail (out of memory, for instance),
 	 * invalidate query texts.  Hopefully this is rare.  It might seem better
 	 * to leave things alone on an OOM failure, but the problem is that the
 	 * file is only going to get bigger; hoping for a future non-OOM result is
 	 * risky and can easily lead to complete denial of service.
+	 *
+	 * This must be a private copy rather than a mapping of the file, since
+	 * the file is rewritten below while we read the old texts.
 	 */
 	pbuffer = ptext_load_file(&pbuffer_size);
 	if (pbuffer == NULL)
@@ -2214,37 +5502,88 @@ gc_ptexts(void)
 	extent = 0;
 	nentries = 0;
 
-	hash_seq_init(&hash_seq, hash_table);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		int			plan_len = entry->plan_len;
-		char	   *plan = ptext_fetch(entry->plan_offset,
-									   plan_len,
-									   pbuffer,
-									   pbuffer_size);
+	/*
+	 * Shared plan texts are written only once, and marked with the gc cycle
+	 * count.  The shared text table needs no lock since all partitions are
+	 * locked.
+	 */
+	new_gc_count = shared_state->gc_count + 1;
 
-		if (plan == NULL)
+	for (part = 0 ; part < num_partitions ; part++)
+	{
+		entry_scan_init(&scan, part, false);
+		while ((entry = entry_scan_next(&scan)) != NULL)
 		{
-			/* Trouble ... drop the text */
-			entry->plan_offset = 0;
-			entry->plan_len = -1;
-			/* entry will not be counted in mean plan length computation */
-			continue;
-		}
+			Size		plan_offset = entry->plan_offset;
+			int			plan_len = entry->plan_len;
+			char	   *plan;
 
-		if (fwrite(plan, 1, plan_len + 1, pfile) != plan_len + 1)
-		{
-			ereport(LOG,
-					(errcode_for_file_access(),
-					 errmsg("could not write file \"%s\": %m",
-							PGSP_TEXT_FILE)));
-			hash_seq_term(&hash_seq);
-			goto gc_fail;
+			text = NULL;
+			if (entry->text_shared)
+			{
+				pgspTextKey	tkey;
+
+				ptext_make_key(&tkey, &entry->key, entry->encoding);
+				text = (pgspPlanText *) hash_search(text_table, &tkey,
+													HASH_FIND, NULL);
+			}
+
+			if (text && text->gc_count == new_gc_count)
+			{
+				/* Already moved with another entry */
+				entry->plan_offset = text->plan_offset;
+				entry->plan_len = text->plan_len;
+				continue;
+			}
+			else if (text)
+			{
+				plan_offset = text->plan_offset;
+				plan_len = text->plan_len;
+				text->gc_count = new_gc_count;
+			}
+
+			plan = ptext_fetch(plan_offset, plan_len,
+							   pbuffer, pbuffer_size);
+
+			if (plan == NULL)
+			{
+				/* Trouble ... drop the text */
+				entry->plan_offset = 0;
+				entry->plan_len = -1;
+				if (text)
+				{
+					text->plan_offset = 0;
+					text->plan_len = -1;
+				}
+				/* entry will not be counted in mean plan length computation */
+				continue;
+			}
+
+			if (fwrite(plan, 1, plan_len + 1, pfile) != plan_len + 1)
+			{
+				ereport(LOG,
+						(errcode_for_file_access(),
+						 errmsg("could not write file \"%s\": %m",
+								PGSP_TEXT_FILE)));
+				entry_scan_term(&scan);
+				goto gc_fail;
+			}
+
+			entry->plan_offset = extent;
+			entry->plan_len = plan_len;
+			if (text)
+				text->plan_offset = extent;
+			extent += plan_len + 1;
+			nentries++;
 		}
+	}
 
-		entry->plan_offset = extent;
-		extent += plan_len + 1;
-		nentries++;
+	/* Texts no entry has referenced are not in the new file */
+	hash_seq_init(&hash_seq, text_table);
+	while ((text = (pgspPlanText *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (text->gc_count != new_gc_count)
+			hash_search(text_table, &text->key, HASH_REMOVE, NULL);
 	}
 
 	/*
@@ -2270,8 +5609,9 @@ gc_ptexts(void)
 	elog(DEBUG1, "pgsp gc of queries file shrunk size from %zu to %zu",
 		 shared_state->extent, extent);
 
-	/* Reset the shared extent pointer */
+	/* Reset the shared extent pointer and record the gc */
 	shared_state->extent = extent;
+	shared_state->gc_count++;
 
 	/*
 	 * Also update the mean plan length, to be sure that need_gc_ptexts()
@@ -2297,12 +5637,17 @@ gc_fail:
 	 * Since the contents of the external file are now uncertain, mark all
 	 * hashtable entries as having invalid texts.
 	 */
-	hash_seq_init(&hash_seq, hash_table);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	for (part = 0 ; part < num_partitions ; part++)
 	{
-		entry->plan_offset = 0;
-		entry->plan_len = -1;
+		entry_scan_init(&scan, part, false);
+		while ((entry = entry_scan_next(&scan)) != NULL)
+		{
+			entry->plan_offset = 0;
+			entry->plan_len = -1;
+			entry->text_shared = false;
+		}
 	}
+	ptext_forget_all();
 
 	/*
 	 * Destroy the query text file and create a new, empty one
@@ -2317,36 +5662,500 @@ gc_fail:
 	else
 		FreeFile(pfile);
 
-	/* Reset the shared extent pointer */
+	/* Reset the shared extent pointer and record the gc */
 	shared_state->extent = 0;
+	shared_state->gc_count++;
 
 	/* Reset mean_plan_len to match the new state */
 	shared_state->mean_plan_len = ASSUMED_LENGTH_INIT;
 }
 
+/*
+ * Garbage-collect the external plan text file in the configured way.
+ *
+ * The caller must hold no partition lock.
+ */
+static void
+run_gc_ptexts(void)
+{
+	if (!background_gc)
+	{
+		lock_all_partitions(LW_EXCLUSIVE);
+		gc_ptexts();
+		release_all_partitions();
+		return;
+	}
+
+	/* Leave it to plan writer if running */
+	if (PLAN_WRITER_ENABLED() && plan_queue != NULL)
+	{
+		Latch	   *latch;
+
+		LWLockAcquire(shared_state->queue_lock, LW_SHARED);
+		latch = shared_state->writer_latch;
+		LWLockRelease(shared_state->queue_lock);
+
+		if (latch)
+		{
+			SetLatch(latch);
+			return;
+		}
+	}
+
+	gc_ptexts_background();
+}
+
+/*
+ * Garbage-collect orphaned plan texts into a new file without blocking.
+ *
+ * Unlike gc_ptexts(), the live plan texts are copied into a new file while
+ * holding a shared lock on one partition at a time, so only creation of new
+ * entries in the partition being copied has to wait.  Then, holding all
+ * partitions locked exclusively, the texts appended meanwhile are carried
+ * over, the new file replaces the old one and the entries are redirected,
+ * none of which needs to read the old texts again.
+ *
+ * Any failure leaves the old file and every entry alone, to be retried by the
+ * next garbage collection.
+ *
+ * The caller must hold no partition lock.
+ */
+static void
+gc_ptexts_background(void)
+{
+	Size		boundary;
+	int			gc_count;
+	bool		done;
+
+	Assert (plan_storage == PLAN_STORAGE_FILE);
+
+	/* Only one process runs it at a time */
+	{
+		volatile pgspSharedState *s = (volatile pgspSharedState *) shared_state;
+
+		SpinLockAcquire(&s->mutex);
+		done = s->gc_running;
+		s->gc_running = true;
+		boundary = s->extent;
+		if (!done)
+			s->gc_boundary = boundary;
+		gc_count = s->gc_count;
+		SpinLockRelease(&s->mutex);
+	}
+
+	if (done)
+		return;
+
+	PG_TRY();
+	{
+		/* Someone may have just finished it */
+		if (need_gc_ptexts() && !gc_ptexts_copy(boundary, gc_count))
+			unlink(PGSP_GC_TEXT_FILE);
+	}
+	PG_CATCH();
+	{
+		/* The new file is closed by the error cleanup */
+		gc_unmap_file();
+		unlink(PGSP_GC_TEXT_FILE);
+
+		SpinLockAcquire(&shared_state->mutex);
+		shared_state->gc_running = false;
+		SpinLockRelease(&shared_state->mutex);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	SpinLockAcquire(&shared_state->mutex);
+	shared_state->gc_running = false;
+	SpinLockRelease(&shared_state->mutex);
+}
+
+/*
+ * Workhorse of gc_ptexts_background().
+ *
+ * The plan texts below boundary, the extent when the gc started, are copied
+ * one by one, and the ones above it are appended later as a whole.  Returns
+ * false on failure or if another garbage collection or a reset has got ahead
+ * of us, in which case the new file is left to the caller to remove.
+ *
+ * The plan text file is mapped into gc_pbuffer, which the caller releases on
+ * error.
+ */
+static bool
+gc_ptexts_copy(Size boundary, int gc_count)
+{
+	FILE	   *pfile;
+	HTAB	   *moved;
+	HASHCTL		ctl;
+	pgspEntryScan scan;
+	pgspEntry  *entry;
+	HASH_SEQ_STATUS hash_seq;
+	pgspPlanText *text;
+	Size		extent;
+	Size		tail_len;
+	Size		old_extent;
+	int			ntexts;
+	int			part;
+
+	pfile = AllocateFile(PGSP_GC_TEXT_FILE, PG_BINARY_W);
+	if (pfile == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m",
+						PGSP_GC_TEXT_FILE)));
+		return false;
+	}
+
+	/*
+	 * Texts shared among entries are copied only once.  The table goes away
+	 * with the current memory context on error.
+	 */
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Size);
+	ctl.entrysize = sizeof(pgspMovedText);
+	ctl.hcxt = CurrentMemoryContext;
+	moved = hash_create("pg_store_plans moved texts", 1024, &ctl,
+						HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	extent = 0;
+
+	/*
+	 * Copy the texts of each partition, and finally the shared texts, which
+	 * entries created in the partitions already copied may have started to
+	 * use after the last entries using them in the partitions not yet copied
+	 * went away.  Any shared text that joins the table after that is above
+	 * the boundary or has been copied, as texts below the boundary are
+	 * stored again before a new entry refers to them, see ptext_behind_gc().
+	 * Any partition lock does to read the shared texts.
+	 */
+	for (part = 0 ; part <= num_partitions ; part++)
+	{
+		LWLock	   *lock = PARTITION_LOCK(part < num_partitions ? part : 0);
+
+		LWLockAcquire(lock, LW_SHARED);
+
+		/* Let the queued plan texts referenced by entries be in the file */
+		ptext_flush();
+
+		/*
+		 * The file may have been truncated by a gc or reset meanwhile, then
+		 * the mapping is no longer safe to read, nor are our copies of any
+		 * use.  Otherwise, texts below the boundary written since the file
+		 * was mapped may be beyond the mapping.
+		 */
+		if (shared_state->gc_count != gc_count)
+		{
+			LWLockRelease(lock);
+			goto fail;
+		}
+		if (gc_pbuffer_size < boundary)
+		{
+			gc_unmap_file();
+			gc_pbuffer = ptext_map_file(&gc_pbuffer_size);
+		}
+		if (gc_pbuffer == NULL)
+		{
+			LWLockRelease(lock);
+			goto fail;
+		}
+
+		if (part < num_partitions)
+		{
+			entry_scan_init(&scan, part, false);
+			while ((entry = entry_scan_next(&scan)) != NULL)
+			{
+				if (!gc_copy_ptext(moved, pfile, &extent,
+								   gc_pbuffer, gc_pbuffer_size, boundary,
+								   entry->plan_offset, entry->plan_len))
+				{
+					entry_scan_term(&scan);
+					LWLockRelease(lock);
+					goto fail;
+				}
+			}
+		}
+		else
+		{
+			LWLockAcquire(shared_state->text_lock, LW_SHARED);
+			hash_seq_init(&hash_seq, text_table);
+			while ((text = (pgspPlanText *) hash_seq_search(&hash_seq)) != NULL)
+			{
+				if (!gc_copy_ptext(moved, pfile, &extent,
+								   gc_pbuffer, gc_pbuffer_size, boundary,
+								   text->plan_offset, text->plan_len))
+				{
+					hash_seq_term(&hash_seq);
+					LWLockRelease(shared_state->text_lock);
+					LWLockRelease(lock);
+					goto fail;
+				}
+			}
+			LWLockRelease(shared_state->text_lock);
+		}
+
+		LWLockRelease(lock);
+	}
+
+	/*
+	 * Now swap the files.  Writers to the old file are all gone once we have
+	 * all partitions locked and the queued texts written out.
+	 */
+	lock_all_partitions(LW_EXCLUSIVE);
+	ptext_flush();
+
+	if (shared_state->gc_count != gc_count)
+		goto fail_locked;
+
+	/* Carry over the texts appended since the gc started */
+	old_extent = shared_state->extent;
+	gc_unmap_file();
+	gc_pbuffer = ptext_map_file(&gc_pbuffer_size);
+
+	tail_len = 0;
+	if (gc_pbuffer && gc_pbuffer_size > boundary)
+		tail_len = Min(gc_pbuffer_size, old_extent) - boundary;
+	if (tail_len > 0 &&
+		fwrite(gc_pbuffer + boundary, 1, tail_len, pfile) != tail_len)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m",
+						PGSP_GC_TEXT_FILE)));
+		goto fail_locked;
+	}
+
+	if (FreeFile(pfile))
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m",
+						PGSP_GC_TEXT_FILE)));
+		pfile = NULL;
+		goto fail_locked;
+	}
+	pfile = NULL;
+
+	/* Readers still having the old file mapped are not affected */
+	if (rename(PGSP_GC_TEXT_FILE, PGSP_TEXT_FILE) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not rename file \"%s\": %m",
+						PGSP_GC_TEXT_FILE)));
+		goto fail_locked;
+	}
+
+	/*
+	 * Redirect the shared texts and then the entries into the new file.  The
+	 * shared text table needs no lock since all partitions are locked.
+	 */
+	ntexts = 0;
+	hash_seq_init(&hash_seq, text_table);
+	while ((text = (pgspPlanText *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!gc_moved_offset(moved, boundary, tail_len, extent,
+							 &text->plan_offset, text->plan_len))
+		{
+			text->plan_offset = 0;
+			text->plan_len = -1;
+		}
+		else
+			ntexts++;
+	}
+
+	for (part = 0 ; part < num_partitions ; part++)
+	{
+		entry_scan_init(&scan, part, false);
+		while ((entry = entry_scan_next(&scan)) != NULL)
+		{
+			text = NULL;
+			if (entry->text_shared)
+			{
+				pgspTextKey	tkey;
+
+				ptext_make_key(&tkey, &entry->key, entry->encoding);
+				text = (pgspPlanText *) hash_search(text_table, &tkey,
+													HASH_FIND, NULL);
+			}
+
+			/* Entries sharing a text follow it as gc_ptexts() does */
+			if (text && text->plan_len >= 0)
+			{
+				entry->plan_offset = text->plan_offset;
+				entry->plan_len = text->plan_len;
+			}
+			else if (!gc_moved_offset(moved, boundary, tail_len, extent,
+									  &entry->plan_offset, entry->plan_len))
+			{
+				entry->plan_offset = 0;
+				entry->plan_len = -1;
+			}
+			else if (!text)
+				ntexts++;
+		}
+	}
+
+	elog(DEBUG1, "pgsp background gc of queries file shrunk size from %zu to %zu",
+		 old_extent, extent + tail_len);
+
+	/* Reset the shared extent pointer and record the gc */
+	shared_state->extent = extent + tail_len;
+	shared_state->gc_count++;
+
+	/* Also update the mean plan length, see gc_ptexts() */
+	if (ntexts > 0)
+		shared_state->mean_plan_len = shared_state->extent / ntexts;
+	else
+		shared_state->mean_plan_len = ASSUMED_LENGTH_INIT;
+
+	release_all_partitions();
+
+	gc_unmap_file();
+	hash_destroy(moved);
+
+	return true;
+
+fail_locked:
+	release_all_partitions();
+
+fail:
+	if (pfile)
+		FreeFile(pfile);
+	gc_unmap_file();
+	hash_destroy(moved);
+
+	return false;
+}
+
+/*
+ * Copy a plan text below boundary into the new file for gc_ptexts_copy(),
+ * unless done already.  Bogus texts are skipped, to be dropped when the new
+ * file is in place.
+ *
+ * Returns false on write failure.
+ */
+static bool
+gc_copy_ptext(HTAB *moved, FILE *pfile, Size *extent,
+			  char *pbuffer, Size pbuffer_size, Size boundary,
+			  Size plan_offset, int plan_len)
+{
+	pgspMovedText *mtext;
+	char	   *plan;
+	bool		found;
+
+	/* Texts above the boundary are carried over later */
+	if (plan_len < 0 || plan_offset >= boundary)
+		return true;
+
+	mtext = (pgspMovedText *) hash_search(moved, &plan_offset,
+										  HASH_ENTER, &found);
+	if (found)
+		return true;
+
+	plan = ptext_fetch(plan_offset, plan_len, pbuffer, pbuffer_size);
+	if (plan == NULL)
+	{
+		hash_search(moved, &plan_offset, HASH_REMOVE, NULL);
+		return true;
+	}
+
+	if (fwrite(plan, 1, plan_len + 1, pfile) != plan_len + 1)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m",
+						PGSP_GC_TEXT_FILE)));
+		return false;
+	}
+
+	mtext->new_offset = *extent;
+	*extent += plan_len + 1;
+	return true;
+}
+
+/*
+ * Release the mapping of the plan text file made by gc_ptexts_copy().  This
+ * is also called on error, so the mapping doesn't stay for the life of the
+ * process.
+ */
+static void
+gc_unmap_file(void)
+{
+	if (gc_pbuffer)
+		ptext_unmap_file(gc_pbuffer, gc_pbuffer_size);
+	gc_pbuffer = NULL;
+	gc_pbuffer_size = 0;
+}
+
+/*
+ * Translate the offset of a plan text in the old file into the new file for
+ * gc_ptexts_copy().  Texts below boundary are looked up in moved, and the
+ * ones in the tail_len bytes above it are shifted to new_tail.
+ *
+ * Returns false if the text didn't make it into the new file.
+ */
+static bool
+gc_moved_offset(HTAB *moved, Size boundary, Size tail_len, Size new_tail,
+				Size *plan_offset, int plan_len)
+{
+	pgspMovedText *mtext;
+
+	if (plan_len < 0)
+		return false;
+
+	if (*plan_offset >= boundary)
+	{
+		if (*plan_offset + plan_len + 1 > boundary + tail_len)
+			return false;
+		*plan_offset = *plan_offset - boundary + new_tail;
+		return true;
+	}
+
+	mtext = (pgspMovedText *) hash_search(moved, plan_offset, HASH_FIND, NULL);
+	if (mtext == NULL)
+		return false;
+	*plan_offset = mtext->new_offset;
+	return true;
+}
+
 /*
  * Release all entries.
  */
 static void
 entry_reset(void)
 {
-	HASH_SEQ_STATUS hash_seq;
+	pgspEntryScan scan;
 	pgspEntry  *entry;
 	FILE	   *pfile;
+	int			part;
 
-	if (!shared_state || !hash_table)
+	if (!TABLE_READY())
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_store_plans must be loaded via shared_preload_libraries")));
 
-	LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+	/*
+	 * Local counters of this backend are thrown away. Those of other backends
+	 * are discarded at their next flush since the entries are gone.
+	 */
+	pending_discard();
+
+	lock_all_partitions(LW_EXCLUSIVE);
 
-	hash_seq_init(&hash_seq, hash_table);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	for (part = 0 ; part < num_partitions ; part++)
 	{
-		hash_search(hash_table, &entry->key, HASH_REMOVE, NULL);
+		entry_scan_init(&scan, part, true);
+		while ((entry = entry_scan_next(&scan)) != NULL)
+		{
+			ptext_release(entry);
+			entry_scan_remove(&scan, entry);
+		}
 	}
 
+	if (plan_storage == PLAN_STORAGE_FILE)
+		ptext_forget_all();
+
 	/*
 	 * Reset global statistics for pg_store_plans.
 	 */
@@ -2356,10 +6165,14 @@ entry_reset(void)
 
 		SpinLockAcquire(&s->mutex);
 		s->stats.dealloc = 0;
+		s->stats.collisions = 0;
 		s->stats.stats_reset = stats_reset;
 		SpinLockRelease(&s->mutex);
 	}
 
+	/* Make sure no queued plan is written after truncation */
+	ptext_flush();
+
 	/*
 	 * Write new empty plan file, perhaps even creating a new one to recover
 	 * if the file was missing.
@@ -2384,8 +6197,13 @@ entry_reset(void)
 	FreeFile(pfile);
 
 done:
+	/*
+	 * This counts as a plan text garbage collection for our purposes, and
+	 * makes readers drop their mappings of the truncated file.
+	 */
 	shared_state->extent = 0;
-	LWLockRelease(shared_state->lock);
+	shared_state->gc_count++;
+	release_all_partitions();
 }
 
 Datum
@@ -11,6 +11,12 @@
  */
 
 #include "postgres.h"
+#include "access/hash.h"
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
 #if PG_VERSION_NUM >= 130000
 #include "mb/pg_wchar.h"
 #endif
@@ -21,6 +27,8 @@
 #include "parser/scanner.h"
 #include "utils/xml.h"
 #include "utils/json.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
 #if PG_VERSION_NUM < 130000
 #include "utils/jsonapi.h"
 #else
@@ -28,6 +36,7 @@
 #endif
 #include "pgsp_json.h"
 #include "pgsp_json_int.h"
+#include "pgsp_planid.h"
 
 #if PG_VERSION_NUM < 160000
 #include "parser/gram.h"
@@ -42,6 +51,34 @@
 
 #define INDENT_STEP 2
 
+/*
+ * Limits of the normalization cache. The whole cache is thrown away when
+ * either of them is reached.
+ */
+#define NORM_CACHE_ENTRIES	1024			/* max # of cached expressions */
+#define NORM_CACHE_BYTES	(1024 * 1024)	/* max bytes of cached strings */
+
+/*
+ * Backend-local cache entry of normalize_expr() results. Expressions are
+ * looked up by hash value and then compared as a whole.
+ */
+typedef struct pgspNormCacheEntry
+{
+	uint64		hash;			/* hash key of entry - MUST BE FIRST */
+	char	   *expr;			/* original expression */
+	char	   *normalized;		/* normalized expression */
+} pgspNormCacheEntry;
+
+/*
+ * Patterns of relation names to be masked in plan ids, as a sequence of
+ * NUL-terminated strings ended by an empty string. NULL if none.
+ */
+const char *pgsp_relname_patterns = NULL;
+
+static MemoryContext norm_cache_context = NULL;
+static HTAB *norm_cache = NULL;
+static Size norm_cache_bytes = 0;
+
 
 void normalize_expr(char *expr, bool preserve_space);
 static const char *converter_core(word_table *tbl,
@@ -80,6 +117,62 @@ static JsonParseErrorType xml_scalar(void *state, char *token,
 static void init_json_semaction(JsonSemAction *sem,
 										  pgspParserContext *ctx);
 
+/*
+ * State of an Append or Merge Append node whose children are being folded.
+ * The children are hashed separately and the set of their distinct hash
+ * values is fed into the jumble state of the enclosing plan.
+ */
+typedef struct
+{
+	int			level;			/* object level of the node */
+	bool		in_plans;		/* in the Plans array of the node */
+	bool		saved;			/* outer holds the enclosing jumble state */
+	pgspJumbleState outer;		/* jumble state of the enclosing plan */
+	uint64	   *hashes;			/* hash values of the children */
+	int			nhashes;		/* # of valid entries in hashes */
+	int			maxhashes;		/* allocated length of hashes */
+} pgspFoldFrame;
+
+/*
+ * Parser context to normalize and shorten a plan at once. The normalized
+ * representation is fed into the jumble state as soon as it is generated
+ * instead of being accumulated.
+ */
+typedef struct
+{
+	pgspParserContext shorten;		/* context for shortened output */
+	pgspParserContext normalize;	/* context for normalized output */
+	bool		emit_shorten;		/* true to generate shortened output */
+	pgspJumbleState js;				/* jumble state for normalized output */
+	int			flags;				/* PGSP_* flags for plan id calculation */
+	int			level;				/* current object level */
+	bool		node_type_next;		/* next scalar is a node type */
+	bool		schema_next;		/* next scalar is a schema name */
+	bool		relname_next;		/* next scalar is a relation name or alias */
+	int			nfolding;			/* # of frames in their Plans array */
+	pgspFoldFrame *frames;			/* stack of Append nodes being folded */
+	int			nframes;			/* # of frames in the stack */
+	int			maxframes;			/* allocated length of frames */
+} pgspNormHashContext;
+
+static void normhash_flush(pgspNormHashContext *ctx);
+static void fold_push(pgspNormHashContext *ctx);
+static void fold_pop(pgspNormHashContext *ctx);
+static void fold_finish_plans(pgspNormHashContext *ctx, pgspFoldFrame *frame);
+static int	uint64_cmp(const void *a, const void *b);
+static bool wildcard_match(const char *pattern, const char *str);
+static JsonParseErrorType normhash_objstart(void *state);
+static JsonParseErrorType normhash_objend(void *state);
+static JsonParseErrorType normhash_arrstart(void *state);
+static JsonParseErrorType normhash_arrend(void *state);
+static JsonParseErrorType normhash_ofstart(void *state, char *fname,
+										   bool isnull);
+static JsonParseErrorType normhash_ofend(void *state, char *fname,
+										 bool isnull);
+static JsonParseErrorType normhash_aestart(void *state, bool isnull);
+static JsonParseErrorType normhash_scalar(void *state, char *token,
+										  JsonTokenType tokentype);
+
 word_table propfields[] =
 {
 	{P_NodeType,		"t" ,"Node Type",			NULL, true,  conv_nodetype,		SETTER(node_type)},
@@ -651,17 +744,83 @@ normalize_expr(char *expr, bool preserve_space)
 	*wp = 0;
 }
 
+/*
+ * normalize_expr_cached - normalize_expr() with memoization
+ *
+ * The same expressions appear in every execution of the same query, so the
+ * results are cached to avoid running the scanner on them again.  The result
+ * is owned by the cache and valid only until the next call.
+ */
+const char *
+normalize_expr_cached(const char *expr, bool preserve_space)
+{
+	pgspNormCacheEntry *entry;
+	Size		len = strlen(expr);
+	uint64		hash;
+	bool		found;
+	char	   *normalized;
+
+	hash = DatumGetUInt64(hash_any_extended((const unsigned char *) expr,
+											len, preserve_space));
+
+	if (norm_cache != NULL &&
+		(hash_get_num_entries(norm_cache) >= NORM_CACHE_ENTRIES ||
+		 norm_cache_bytes + 2 * (len + 1) > NORM_CACHE_BYTES))
+	{
+		/* The hash table lives in the context and goes away with it */
+		MemoryContextReset(norm_cache_context);
+		norm_cache = NULL;
+		norm_cache_bytes = 0;
+	}
+
+	if (norm_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		if (norm_cache_context == NULL)
+			norm_cache_context =
+				AllocSetContextCreate(TopMemoryContext,
+									  "pg_store_plans normalization cache",
+									  ALLOCSET_DEFAULT_SIZES);
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint64);
+		ctl.entrysize = sizeof(pgspNormCacheEntry);
+		ctl.hcxt = norm_cache_context;
+		norm_cache = hash_create("pg_store_plans normalization cache",
+								 NORM_CACHE_ENTRIES, &ctl,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = (pgspNormCacheEntry *)
+		hash_search(norm_cache, &hash, HASH_ENTER, &found);
+
+	if (found)
+	{
+		if (strcmp(entry->expr, expr) == 0)
+			return entry->normalized;
+
+		/* Hash collision. Just leave the existing entry alone */
+		normalized = pstrdup(expr);
+		normalize_expr(normalized, preserve_space);
+		return normalized;
+	}
+
+	entry->expr = MemoryContextStrdup(norm_cache_context, expr);
+	entry->normalized = MemoryContextStrdup(norm_cache_context, expr);
+	normalize_expr(entry->normalized, preserve_space);
+	norm_cache_bytes += 2 * (len + 1);
+
+	return entry->normalized;
+}
+
 const char *
 conv_expression(const char *src, pgsp_parser_mode mode)
 {
 	const char *ret = src;
 
 	if (mode == PGSP_JSON_NORMALIZE)
-	{
-		char *t = pstrdup(src);
-		normalize_expr(t, true);
-		ret = (const char *)t;
-	}
+		ret = normalize_expr_cached(src, true);
 	return ret;
 }
 
@@ -1256,6 +1415,399 @@ xml_scalar(void *state, char *token, JsonTokenType tokentype)
 	JSONACTION_RETURN_SUCCESS();
 }
 
+/* Normalize and hash */
+static void
+normhash_flush(pgspNormHashContext *ctx)
+{
+	StringInfo	dest = ctx->normalize.dest;
+
+	if (dest->len > 0)
+	{
+		pgsp_jumble_append(&ctx->js, (const unsigned char *) dest->data,
+						   dest->len);
+		resetStringInfo(dest);
+	}
+}
+
+static JsonParseErrorType
+normhash_objstart(void *state)
+{
+	pgspNormHashContext *ctx = (pgspNormHashContext *)state;
+	pgspFoldFrame *frame = (ctx->nframes > 0 ?
+							&ctx->frames[ctx->nframes - 1] : NULL);
+
+	/* A child of a folded node is hashed separately */
+	if (frame && frame->in_plans && ctx->level == frame->level)
+	{
+		if (!frame->saved)
+		{
+			frame->outer = ctx->js;
+			frame->saved = true;
+		}
+		pgsp_jumble_init(&ctx->js);
+	}
+	ctx->level++;
+
+	if (ctx->emit_shorten)
+		json_objstart(&ctx->shorten);
+	json_objstart(&ctx->normalize);
+	normhash_flush(ctx);
+
+	JSONACTION_RETURN_SUCCESS();
+}
+
+static JsonParseErrorType
+normhash_objend(void *state)
+{
+	pgspNormHashContext *ctx = (pgspNormHashContext *)state;
+	pgspFoldFrame *frame;
+
+	if (ctx->emit_shorten)
+		json_objend(&ctx->shorten);
+	json_objend(&ctx->normalize);
+	normhash_flush(ctx);
+	ctx->level--;
+
+	while (ctx->nframes > 0)
+	{
+		frame = &ctx->frames[ctx->nframes - 1];
+
+		/* End of a folded node, which may be a child of another one */
+		if (ctx->level < frame->level)
+		{
+			fold_pop(ctx);
+			continue;
+		}
+
+		if (frame->in_plans && ctx->level == frame->level)
+		{
+			/* End of a child of a folded node */
+			if (frame->nhashes >= frame->maxhashes)
+			{
+				frame->maxhashes *= 2;
+				frame->hashes = (uint64 *)
+					repalloc(frame->hashes,
+							 sizeof(uint64) * frame->maxhashes);
+			}
+			frame->hashes[frame->nhashes++] =
+				pgsp_jumble_finish(&ctx->js, NULL);
+
+			/* Separators between the children go nowhere */
+			pgsp_jumble_init(&ctx->js);
+		}
+		break;
+	}
+
+	JSONACTION_RETURN_SUCCESS();
+}
+
+static JsonParseErrorType
+normhash_arrstart(void *state)
+{
+	pgspNormHashContext *ctx = (pgspNormHashContext *)state;
+
+	if (ctx->emit_shorten)
+		json_arrstart(&ctx->shorten);
+	json_arrstart(&ctx->normalize);
+	normhash_flush(ctx);
+
+	JSONACTION_RETURN_SUCCESS();
+}
+
+static JsonParseErrorType
+normhash_arrend(void *state)
+{
+	pgspNormHashContext *ctx = (pgspNormHashContext *)state;
+	pgspFoldFrame *frame = (ctx->nframes > 0 ?
+							&ctx->frames[ctx->nframes - 1] : NULL);
+
+	if (frame && frame->in_plans && ctx->level == frame->level)
+		fold_finish_plans(ctx, frame);
+
+	if (ctx->emit_shorten)
+		json_arrend(&ctx->shorten);
+	json_arrend(&ctx->normalize);
+	normhash_flush(ctx);
+
+	JSONACTION_RETURN_SUCCESS();
+}
+
+static JsonParseErrorType
+normhash_ofstart(void *state, char *fname, bool isnull)
+{
+	pgspNormHashContext *ctx = (pgspNormHashContext *)state;
+
+	if (ctx->emit_shorten)
+		json_ofstart(&ctx->shorten, fname, isnull);
+	json_ofstart(&ctx->normalize, fname, isnull);
+
+	if (ctx->flags & PGSP_MASK_TEMP_SCHEMAS)
+		ctx->schema_next = (strcmp(fname, "Schema") == 0);
+	/* Aliases default to relation names, so they are masked alike */
+	if (ctx->flags & PGSP_MASK_RELNAMES)
+		ctx->relname_next = (strcmp(fname, "Relation Name") == 0 ||
+							 strcmp(fname, "Alias") == 0);
+
+	if (ctx->flags & PGSP_FOLD_APPENDS)
+	{
+		pgspFoldFrame *frame = (ctx->nframes > 0 ?
+								&ctx->frames[ctx->nframes - 1] : NULL);
+
+		ctx->node_type_next = (strcmp(fname, "Node Type") == 0);
+
+		if (frame && !frame->in_plans && ctx->level == frame->level &&
+			strcmp(fname, "Plans") == 0)
+		{
+			frame->in_plans = true;
+			ctx->nfolding++;
+		}
+		else if (ctx->nfolding > 0 &&
+				 (strcmp(fname, "Relation Name") == 0 ||
+				  strcmp(fname, "Schema") == 0 ||
+				  strcmp(fname, "Alias") == 0 ||
+				  strcmp(fname, "Index Name") == 0))
+		{
+			/* Identities of relations in folded children are ignored */
+			resetStringInfo(ctx->normalize.dest);
+			ctx->normalize.remove = true;
+		}
+	}
+
+	normhash_flush(ctx);
+
+	JSONACTION_RETURN_SUCCESS();
+}
+
+static JsonParseErrorType
+normhash_ofend(void *state, char *fname, bool isnull)
+{
+	pgspNormHashContext *ctx = (pgspNormHashContext *)state;
+
+	if (ctx->emit_shorten)
+		json_ofend(&ctx->shorten, fname, isnull);
+	json_ofend(&ctx->normalize, fname, isnull);
+
+	JSONACTION_RETURN_SUCCESS();
+}
+
+static JsonParseErrorType
+normhash_aestart(void *state, bool isnull)
+{
+	pgspNormHashContext *ctx = (pgspNormHashContext *)state;
+
+	if (ctx->emit_shorten)
+		json_aestart(&ctx->shorten, isnull);
+	json_aestart(&ctx->normalize, isnull);
+	normhash_flush(ctx);
+
+	JSONACTION_RETURN_SUCCESS();
+}
+
+static JsonParseErrorType
+normhash_scalar(void *state, char *token, JsonTokenType tokentype)
+{
+	pgspNormHashContext *ctx = (pgspNormHashContext *)state;
+
+	if (ctx->emit_shorten)
+		json_scalar(&ctx->shorten, token, tokentype);
+
+	/* Names are masked only in the normalized representation */
+	if (ctx->schema_next)
+		json_scalar(&ctx->normalize,
+					(char *) pgsp_mask_schema_name(token), tokentype);
+	else if (ctx->relname_next)
+		json_scalar(&ctx->normalize,
+					(char *) pgsp_mask_relation_name(token), tokentype);
+	else
+		json_scalar(&ctx->normalize, token, tokentype);
+	normhash_flush(ctx);
+	ctx->schema_next = ctx->relname_next = false;
+
+	if (ctx->node_type_next)
+	{
+		ctx->node_type_next = false;
+		if (strcmp(token, "Append") == 0 ||
+			strcmp(token, "Merge Append") == 0)
+			fold_push(ctx);
+	}
+
+	JSONACTION_RETURN_SUCCESS();
+}
+
+/*
+ * Start folding the children of the Append node at the current level
+ */
+static void
+fold_push(pgspNormHashContext *ctx)
+{
+	pgspFoldFrame *frame;
+
+	if (ctx->frames == NULL)
+	{
+		ctx->maxframes = 4;
+		ctx->frames = (pgspFoldFrame *)
+			palloc(sizeof(pgspFoldFrame) * ctx->maxframes);
+	}
+	else if (ctx->nframes >= ctx->maxframes)
+	{
+		ctx->maxframes *= 2;
+		ctx->frames = (pgspFoldFrame *)
+			repalloc(ctx->frames, sizeof(pgspFoldFrame) * ctx->maxframes);
+	}
+
+	frame = &ctx->frames[ctx->nframes++];
+	frame->level = ctx->level;
+	frame->in_plans = false;
+	frame->saved = false;
+	frame->maxhashes = 8;
+	frame->nhashes = 0;
+	frame->hashes = (uint64 *) palloc(sizeof(uint64) * frame->maxhashes);
+}
+
+/*
+ * Finish folding the node on the top of the stack
+ */
+static void
+fold_pop(pgspNormHashContext *ctx)
+{
+	pgspFoldFrame *frame = &ctx->frames[ctx->nframes - 1];
+
+	if (frame->in_plans)
+		fold_finish_plans(ctx, frame);
+	pfree(frame->hashes);
+	ctx->nframes--;
+}
+
+/*
+ * Feed the distinct hash values of the children of the folded node into the
+ * jumble state of the enclosing plan, which is restored.
+ */
+static void
+fold_finish_plans(pgspNormHashContext *ctx, pgspFoldFrame *frame)
+{
+	int			nunique = 0;
+	int			i;
+
+	if (frame->saved)
+		ctx->js = frame->outer;
+
+	qsort(frame->hashes, frame->nhashes, sizeof(uint64), uint64_cmp);
+	for (i = 0; i < frame->nhashes; i++)
+	{
+		if (nunique == 0 || frame->hashes[nunique - 1] != frame->hashes[i])
+			frame->hashes[nunique++] = frame->hashes[i];
+	}
+	pgsp_jumble_append(&ctx->js, (const unsigned char *) frame->hashes,
+					   sizeof(uint64) * nunique);
+
+	frame->in_plans = false;
+	frame->saved = false;
+	frame->nhashes = 0;
+	ctx->nfolding--;
+}
+
+static int
+uint64_cmp(const void *a, const void *b)
+{
+	uint64		ua = *(const uint64 *) a;
+	uint64		ub = *(const uint64 *) b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+/*
+ * pgsp_mask_schema_name - mask the backend number of temporary schemas
+ *
+ * "pg_temp_N" and "pg_toast_temp_N" are replaced with "pg_temp" and
+ * "pg_toast_temp" so that the same plan on temporary tables gets the same
+ * plan id in every session.
+ */
+const char *
+pgsp_mask_schema_name(const char *name)
+{
+	const char *masked;
+	const char *p;
+
+	if (strncmp(name, "pg_temp_", 8) == 0)
+	{
+		masked = "pg_temp";
+		p = name + 8;
+	}
+	else if (strncmp(name, "pg_toast_temp_", 14) == 0)
+	{
+		masked = "pg_toast_temp";
+		p = name + 14;
+	}
+	else
+		return name;
+
+	if (*p == '\0' || strspn(p, "0123456789") != strlen(p))
+		return name;
+
+	return masked;
+}
+
+/*
+ * pgsp_mask_relation_name - mask relation names matching the patterns
+ *
+ * Returns the first pattern in pgsp_relname_patterns that name matches, which
+ * stands for all the names matching it, or name itself if none.
+ */
+const char *
+pgsp_mask_relation_name(const char *name)
+{
+	const char *pattern;
+
+	if (pgsp_relname_patterns == NULL)
+		return name;
+
+	for (pattern = pgsp_relname_patterns; *pattern;
+		 pattern += strlen(pattern) + 1)
+	{
+		if (wildcard_match(pattern, name))
+			return pattern;
+	}
+
+	return name;
+}
+
+/*
+ * wildcard_match - match a string against a pattern in which '*' matches any
+ * sequence of characters and '?' matches any single character
+ */
+static bool
+wildcard_match(const char *pattern, const char *str)
+{
+	const char *star = NULL;
+	const char *backtrack = NULL;
+
+	while (*str)
+	{
+		if (*pattern == '*')
+		{
+			star = pattern++;
+			backtrack = str;
+		}
+		else if (*pattern == '?' || *pattern == *str)
+		{
+			pattern++;
+			str++;
+		}
+		else if (star)
+		{
+			pattern = star + 1;
+			str = ++backtrack;
+		}
+		else
+			return false;
+	}
+
+	while (*pattern == '*')
+		pattern++;
+
+	return *pattern == '\0';
+}
+
 /********************************/
 void
 init_parser_context(pgspParserContext *ctx, int mode,
@@ -1388,6 +1940,70 @@ pgsp_json_normalize(char *json)
 	return ctx.dest->data;
 }
 
+/*
+ * pgsp_json_normalized_hash: hash the normalized representation of a plan
+ *
+ * Returns the 64-bit hash value of pgsp_json_normalize() output, which is
+ * never materialized, and stores its check value into *check. If shortened is
+ * not NULL, the shortened representation is also generated in the same parse
+ * and stored there.  flags are the PGSP_* flags for plan id calculation.
+ * With PGSP_FOLD_APPENDS, the children of Append and Merge Append nodes are
+ * hashed as a set of distinct shapes ignoring relation names.  With
+ * PGSP_MASK_TEMP_SCHEMAS and PGSP_MASK_RELNAMES, names of temporary schemas
+ * and relations matching pgsp_relname_patterns are masked.
+ */
+uint64
+pgsp_json_normalized_hash(char *json, int flags, char **shortened,
+						  uint32 *check)
+{
+	JsonLexContext lex;
+	JsonSemAction sem;
+	pgspNormHashContext ctx;
+
+	init_json_lex_context(&lex, json);
+	init_parser_context(&ctx.normalize, PGSP_JSON_NORMALIZE, json, NULL, 0);
+	ctx.emit_shorten = (shortened != NULL);
+	if (ctx.emit_shorten)
+		init_parser_context(&ctx.shorten, PGSP_JSON_SHORTEN, json, NULL, 0);
+	pgsp_jumble_init(&ctx.js);
+	ctx.flags = flags;
+	ctx.level = 0;
+	ctx.node_type_next = false;
+	ctx.schema_next = false;
+	ctx.relname_next = false;
+	ctx.nfolding = 0;
+	ctx.frames = NULL;
+	ctx.nframes = 0;
+	ctx.maxframes = 0;
+
+	sem.semstate = (void*)&ctx;
+	sem.object_start       = normhash_objstart;
+	sem.object_end         = normhash_objend;
+	sem.array_start        = normhash_arrstart;
+	sem.array_end          = normhash_arrend;
+	sem.object_field_start = normhash_ofstart;
+	sem.object_field_end   = normhash_ofend;
+	sem.array_element_start= normhash_aestart;
+	sem.array_element_end  = NULL;
+	sem.scalar             = normhash_scalar;
+
+	run_pg_parse_json(&lex, &sem);
+
+	/* Nodes left open by truncated input */
+	while (ctx.nframes > 0)
+		fold_pop(&ctx);
+	if (ctx.frames)
+		pfree(ctx.frames);
+
+	pfree(ctx.normalize.dest->data);
+	pfree(ctx.normalize.dest);
+
+	if (shortened)
+		*shortened = ctx.shorten.dest->data;
+
+	return pgsp_jumble_finish(&ctx.js, check);
+}
+
 char *
 pgsp_json_inflate(char *json)
 {
@@ -13,8 +13,16 @@
 #include "pgsp_json_text.h"
 
 extern char *pgsp_json_normalize(char *json);
+extern uint64 pgsp_json_normalized_hash(char *json, int flags,
+										char **shortened, uint32 *check);
 extern char *pgsp_json_shorten(char *json);
 extern char *pgsp_json_inflate(char *json);
 extern char *pgsp_json_yamlize(char *json);
 extern char *pgsp_json_xmlize(char *json);
 extern void normalize_expr(char *expr, bool preserve_space);
+extern const char *normalize_expr_cached(const char *expr,
+										 bool preserve_space);
+extern const char *pgsp_mask_schema_name(const char *name);
+extern const char *pgsp_mask_relation_name(const char *name);
+
+extern const char *pgsp_relname_patterns;
@@ -0,0 +1,1093 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_planid.c: Calculate plan identifiers by walking plan trees
+ *
+ * pg_store_plans originally identifies plans by hashing the normalized JSON
+ * representation of EXPLAIN output, which requires the plan to be explained
+ * and parsed on every execution.  The functions here instead fingerprint the
+ * PlannedStmt tree directly, taking node types, relation and index OIDs, join
+ * types and expressions with constants masked into account, so that the plan
+ * id is known without producing any text.
+ *
+ * Plan ids are also cached per backend keyed by the address of PlannedStmt,
+ * so that repeated executions of a cached plan, such as the generic plan of a
+ * prepared statement, need not calculate them again.  The last verified plan
+ * id of each query is remembered as well for plan id sampling, and so is the
+ * time of the last analyzed execution of each query for sampled EXPLAIN
+ * ANALYZE, and so are the names of relations to mask in plan ids.
+ *
+ * Copyright (c) 2012-2024, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * IDENTIFICATION
+ *	  pg_store_plans/pgsp_planid.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/hash.h"
+#include "access/xact.h"
+#include "catalog/pg_class.h"
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
+#if PG_VERSION_NUM >= 170000
+#include "common/hashfn_unstable.h"
+#endif
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
+#include "miscadmin.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/plannodes.h"
+#include "parser/parsetree.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "pgsp_json.h"
+#include "pgsp_planid.h"
+
+/* Working state for pgsp_plan_fingerprint */
+typedef struct pgspTreeJumble
+{
+	pgspJumbleState js;			/* jumble state */
+	PlannedStmt *pstmt;			/* the statement being jumbled */
+	bool		verbose;		/* take target lists into account */
+	int			flags;			/* PGSP_* flags for plan id calculation */
+	bool		mask_relations;	/* ignore identities of relations */
+} pgspTreeJumble;
+
+/*
+ * Backend-local plan id cache entry.  A PlannedStmt lives until the memory
+ * context holding it is reset or deleted, for example when the CachedPlan
+ * containing it is released, and the entry is removed at that time.
+ */
+typedef struct pgspPlanIdCacheEntry
+{
+	PlannedStmt *pstmt;			/* hash key of entry - MUST BE FIRST */
+	Plan	   *planTree;		/* planTree of pstmt, for sanity check */
+	uint64		queryid;		/* queryId of pstmt, for sanity check */
+	int			variant;		/* settings the plan id was calculated with */
+	uint64		planid;			/* plan identifier */
+	uint32		check;			/* check value of the plan */
+} pgspPlanIdCacheEntry;
+
+static HTAB *planid_cache = NULL;
+
+/*
+ * Backend-local entry remembering the last verified plan id of a query, used
+ * by plan id sampling.
+ */
+typedef struct pgspSampleKey
+{
+	uint64		queryid;		/* query identifier */
+	int			variant;		/* settings the plan id was calculated with */
+} pgspSampleKey;
+
+typedef struct pgspSampleEntry
+{
+	pgspSampleKey key;			/* hash key of entry - MUST BE FIRST */
+	uint64		planid;			/* last verified plan identifier */
+	double		rate;			/* current sampling rate of this query */
+} pgspSampleEntry;
+
+static HTAB *sample_cache = NULL;
+
+/*
+ * Backend-local entry remembering when a query was last executed with
+ * per-node instrumentation.
+ */
+typedef struct pgspAnalyzeEntry
+{
+	uint64		queryid;		/* hash key of entry - MUST BE FIRST */
+	TimestampTz last_analyzed;	/* start time of the last analyzed execution */
+} pgspAnalyzeEntry;
+
+static HTAB *analyze_cache = NULL;
+
+/*
+ * Backend-local entry remembering the catalog data of a relation used to mask
+ * it in plan ids, so that the catalogs are looked up once per relation rather
+ * than on every execution.  The entry is removed on relcache invalidation.
+ */
+typedef struct pgspRelationEntry
+{
+	Oid			relid;			/* hash key of entry - MUST BE FIRST */
+	bool		istemp;			/* a temporary relation */
+	NameData	relname;		/* name of the relation */
+} pgspRelationEntry;
+
+static HTAB *relation_cache = NULL;
+
+#define APP_JUMB(item) \
+	pgsp_jumble_append(js, (const unsigned char *) &(item), sizeof(item))
+#define APP_JUMB_ARRAY(ary, n) \
+	pgsp_jumble_append(js, (const unsigned char *) (ary), sizeof(*(ary)) * (n))
+
+static void jumble_flush(pgspJumbleState *js);
+static void jumble_plan(pgspTreeJumble *ctx, Plan *plan);
+static void jumble_plan_list(pgspTreeJumble *ctx, List *plans);
+static void jumble_relation(pgspTreeJumble *ctx, Index rti);
+static void jumble_index(pgspTreeJumble *ctx, Oid indexid);
+static void jumble_folded_plans(pgspTreeJumble *ctx, Bitmapset *apprelids,
+								List *plans);
+static int	uint64_cmp(const void *a, const void *b);
+static void jumble_expr(pgspTreeJumble *ctx, Node *node);
+static bool jumble_expr_walker(Node *node, void *context);
+static void planid_cache_forget(void *arg);
+static pgspSampleEntry *sample_cache_find(uint64 queryid, int variant,
+										  bool create, int max_entries);
+static bool random_sample(double rate);
+static pgspRelationEntry *relation_cache_find(Oid relid);
+static void relation_cache_invalidate(Datum arg, Oid relid);
+
+/*
+ * pgsp_jumble_init: initialize a jumble state
+ */
+void
+pgsp_jumble_init(pgspJumbleState *js)
+{
+	js->jumble_len = 0;
+	js->hash = 0;
+	INIT_CRC32C(js->check);
+}
+
+/*
+ * jumble_flush: fold the buffered bytes into the hash and the check value
+ *
+ * The hash value so far is used as the seed of the next chunk.  fasthash is
+ * used where available since it is considerably faster than hash_any() on
+ * long inputs.
+ */
+static void
+jumble_flush(pgspJumbleState *js)
+{
+#if PG_VERSION_NUM >= 170000
+	js->hash = fasthash64((const char *) js->jumble, js->jumble_len, js->hash);
+#else
+	js->hash = DatumGetUInt64(hash_any_extended(js->jumble, js->jumble_len,
+												js->hash));
+#endif
+	COMP_CRC32C(js->check, js->jumble, js->jumble_len);
+	js->jumble_len = 0;
+}
+
+/*
+ * pgsp_jumble_append: feed bytes into a jumble state
+ *
+ * Whenever the buffer fills up, its contents are folded into the running hash
+ * value so the memory usage stays constant regardless of the input size.
+ */
+void
+pgsp_jumble_append(pgspJumbleState *js, const unsigned char *item, Size size)
+{
+	while (size > 0)
+	{
+		Size		part_size;
+
+		if (js->jumble_len >= PGSP_JUMBLE_SIZE)
+			jumble_flush(js);
+
+		part_size = Min(size, PGSP_JUMBLE_SIZE - js->jumble_len);
+		memcpy(js->jumble + js->jumble_len, item, part_size);
+		js->jumble_len += part_size;
+		item += part_size;
+		size -= part_size;
+	}
+}
+
+/*
+ * pgsp_jumble_finish: returns the 64-bit hash value of the whole input
+ *
+ * If check is not NULL, the CRC of the input is stored there to verify that
+ * inputs having the same hash value are really the same.  Neither the hash
+ * value nor the check value is zero.
+ */
+uint64
+pgsp_jumble_finish(pgspJumbleState *js, uint32 *check)
+{
+	jumble_flush(js);
+	FIN_CRC32C(js->check);
+
+	if (check)
+		*check = (js->check != 0 ? js->check : 1);
+
+	return (js->hash != 0 ? js->hash : 1);
+}
+
+/*
+ * pgsp_plan_fingerprint: calculate plan id from a plan tree
+ *
+ * If verbose is true, target lists are also taken into account as the Output
+ * property of EXPLAIN VERBOSE does for the JSON-based plan id.  flags are the
+ * PGSP_* flags for plan id calculation.  The check value of the plan is stored
+ * into *check.
+ */
+uint64
+pgsp_plan_fingerprint(PlannedStmt *pstmt, bool verbose, int flags,
+					  uint32 *check)
+{
+	pgspTreeJumble ctx;
+	pgspJumbleState *js = &ctx.js;
+	ListCell   *lc;
+
+	pgsp_jumble_init(js);
+	ctx.pstmt = pstmt;
+	ctx.verbose = verbose;
+	ctx.flags = flags;
+	ctx.mask_relations = false;
+
+	APP_JUMB(pstmt->commandType);
+	jumble_plan(&ctx, pstmt->planTree);
+
+	/* SubPlans and InitPlans are referred to by their index in this list */
+	foreach(lc, pstmt->subplans)
+		jumble_plan(&ctx, (Plan *) lfirst(lc));
+
+	return pgsp_jumble_finish(js, check);
+}
+
+/*
+ * pgsp_planid_cache_lookup: look up the plan id cache
+ *
+ * Returns true and sets *planid and *check if the plan id of pstmt calculated
+ * under the settings denoted by variant is found.
+ */
+bool
+pgsp_planid_cache_lookup(PlannedStmt *pstmt, int variant, uint64 *planid,
+						 uint32 *check)
+{
+	pgspPlanIdCacheEntry *entry;
+
+	if (planid_cache == NULL)
+		return false;
+
+	entry = (pgspPlanIdCacheEntry *)
+		hash_search(planid_cache, &pstmt, HASH_FIND, NULL);
+
+	if (entry == NULL ||
+		entry->planTree != pstmt->planTree ||
+		entry->queryid != (uint64) pstmt->queryId ||
+		entry->variant != variant)
+		return false;
+
+	*planid = entry->planid;
+	*check = entry->check;
+	return true;
+}
+
+/*
+ * pgsp_planid_cache_store: remember the plan id of pstmt
+ *
+ * Nothing is done if the cache already has max_entries entries.
+ */
+void
+pgsp_planid_cache_store(PlannedStmt *pstmt, int variant, uint64 planid,
+						uint32 check, int max_entries)
+{
+	pgspPlanIdCacheEntry *entry;
+
+	if (max_entries <= 0)
+		return;
+
+	if (planid_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(PlannedStmt *);
+		ctl.entrysize = sizeof(pgspPlanIdCacheEntry);
+		planid_cache = hash_create("pg_store_plans plan id cache", 256,
+								   &ctl, HASH_ELEM | HASH_BLOBS);
+	}
+
+	entry = (pgspPlanIdCacheEntry *)
+		hash_search(planid_cache, &pstmt, HASH_FIND, NULL);
+
+	if (entry == NULL)
+	{
+		MemoryContext cxt = GetMemoryChunkContext(pstmt);
+		MemoryContextCallback *cb;
+
+		if (hash_get_num_entries(planid_cache) >= max_entries)
+			return;
+
+		/* Forget the entry when the memory for the statement goes away */
+		cb = (MemoryContextCallback *)
+			MemoryContextAlloc(cxt, sizeof(MemoryContextCallback));
+		cb->func = planid_cache_forget;
+		cb->arg = (void *) pstmt;
+		MemoryContextRegisterResetCallback(cxt, cb);
+
+		entry = (pgspPlanIdCacheEntry *)
+			hash_search(planid_cache, &pstmt, HASH_ENTER, NULL);
+	}
+
+	entry->planTree = pstmt->planTree;
+	entry->queryid = (uint64) pstmt->queryId;
+	entry->variant = variant;
+	entry->planid = planid;
+	entry->check = check;
+}
+
+/*
+ * planid_cache_forget: memory context callback to remove a cache entry
+ */
+static void
+planid_cache_forget(void *arg)
+{
+	PlannedStmt *pstmt = (PlannedStmt *) arg;
+
+	if (planid_cache)
+		hash_search(planid_cache, &pstmt, HASH_REMOVE, NULL);
+}
+
+/*
+ * pgsp_sample_skip: decide whether to skip verification of the plan id
+ *
+ * Returns true and sets *planid to the last verified plan id of the query if
+ * it is known and this execution is not sampled.  If adaptive is true, the
+ * sampling rate of each query given by pgsp_sample_verified() is used
+ * instead of sample_rate.
+ */
+bool
+pgsp_sample_skip(uint64 queryid, int variant, double sample_rate,
+				 bool adaptive, uint64 *planid)
+{
+	pgspSampleEntry *entry;
+	double		rate;
+
+	entry = sample_cache_find(queryid, variant, false, 0);
+	if (entry == NULL)
+		return false;
+
+	rate = (adaptive ? entry->rate : sample_rate);
+
+	if (random_sample(rate))
+		return false;
+
+	*planid = entry->planid;
+	return true;
+}
+
+/*
+ * pgsp_sample_verified: remember the plan id calculated for the query
+ *
+ * The sampling rate of the query is halved down to sample_rate while the plan
+ * id stays the same, and reset to 1.0 when it changes.  Nothing is done if
+ * the query is not known and there are already max_entries entries.
+ */
+void
+pgsp_sample_verified(uint64 queryid, int variant, uint64 planid,
+					 double sample_rate, int max_entries)
+{
+	pgspSampleEntry *entry;
+
+	entry = sample_cache_find(queryid, variant, true, max_entries);
+	if (entry == NULL)
+		return;
+
+	if (entry->planid == planid)
+		entry->rate = Max(entry->rate / 2, sample_rate);
+	else
+	{
+		entry->planid = planid;
+		entry->rate = 1.0;
+	}
+}
+
+/*
+ * pgsp_analyze_sample: decide whether to instrument an execution per node
+ *
+ * An execution is selected with the probability of sample_rate, but not
+ * sooner than min_interval milliseconds after the start of the last selected
+ * execution of the same query in this backend.  The last times are remembered
+ * for up to max_entries queries, and the other queries are not selected while
+ * min_interval is in effect.
+ */
+bool
+pgsp_analyze_sample(uint64 queryid, double sample_rate, int min_interval,
+					int max_entries)
+{
+	pgspAnalyzeEntry *entry;
+	TimestampTz now;
+
+	if (sample_rate < 1.0 && !random_sample(sample_rate))
+		return false;
+
+	if (min_interval <= 0)
+		return true;
+
+	if (analyze_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		if (max_entries <= 0)
+			return false;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint64);
+		ctl.entrysize = sizeof(pgspAnalyzeEntry);
+		analyze_cache = hash_create("pg_store_plans analyze sampling state",
+									256, &ctl, HASH_ELEM | HASH_BLOBS);
+	}
+
+	/* The statement start time is good enough and doesn't cost a clock read */
+	now = GetCurrentStatementStartTimestamp();
+
+	entry = (pgspAnalyzeEntry *)
+		hash_search(analyze_cache, &queryid, HASH_FIND, NULL);
+
+	if (entry == NULL)
+	{
+		if (hash_get_num_entries(analyze_cache) >= max_entries)
+			return false;
+
+		entry = (pgspAnalyzeEntry *)
+			hash_search(analyze_cache, &queryid, HASH_ENTER, NULL);
+	}
+	else if (!TimestampDifferenceExceeds(entry->last_analyzed, now,
+										 min_interval))
+		return false;
+
+	entry->last_analyzed = now;
+	return true;
+}
+
+/*
+ * random_sample: returns true with the probability of rate
+ */
+static bool
+random_sample(double rate)
+{
+#if PG_VERSION_NUM >= 150000
+	return pg_prng_double(&pg_global_prng_state) < rate;
+#else
+	return random() < MAX_RANDOM_VALUE * rate;
+#endif
+}
+
+/*
+ * sample_cache_find: find or create an entry of the sampling state
+ *
+ * A new entry, which has the rate of 1.0 and the plan id of zero, is created
+ * only if create is true and there are less than max_entries entries.
+ */
+static pgspSampleEntry *
+sample_cache_find(uint64 queryid, int variant, bool create, int max_entries)
+{
+	pgspSampleKey key;
+	pgspSampleEntry *entry;
+
+	if (sample_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		if (!create || max_entries <= 0)
+			return NULL;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(pgspSampleKey);
+		ctl.entrysize = sizeof(pgspSampleEntry);
+		sample_cache = hash_create("pg_store_plans sampling state", 256,
+								   &ctl, HASH_ELEM | HASH_BLOBS);
+	}
+
+	/* Clear padding bytes so that the key can be hashed as blob */
+	memset(&key, 0, sizeof(key));
+	key.queryid = queryid;
+	key.variant = variant;
+
+	entry = (pgspSampleEntry *)
+		hash_search(sample_cache, &key, HASH_FIND, NULL);
+
+	if (entry || !create ||
+		hash_get_num_entries(sample_cache) >= max_entries)
+		return entry;
+
+	entry = (pgspSampleEntry *)
+		hash_search(sample_cache, &key, HASH_ENTER, NULL);
+	entry->planid = 0;
+	entry->rate = 1.0;
+
+	return entry;
+}
+
+static void
+jumble_plan_list(pgspTreeJumble *ctx, List *plans)
+{
+	pgspJumbleState *js = &ctx->js;
+	ListCell   *lc;
+	int			nplans = list_length(plans);
+
+	APP_JUMB(nplans);
+	foreach(lc, plans)
+		jumble_plan(ctx, (Plan *) lfirst(lc));
+}
+
+/*
+ * jumble_relation: jumble the relation of a range table entry
+ */
+static void
+jumble_relation(pgspTreeJumble *ctx, Index rti)
+{
+	pgspJumbleState *js = &ctx->js;
+	RangeTblEntry *rte;
+
+	if (rti == 0 || rti > list_length(ctx->pstmt->rtable))
+		return;
+
+	rte = rt_fetch(rti, ctx->pstmt->rtable);
+	APP_JUMB(rte->rtekind);
+	if (rte->rtekind != RTE_RELATION || ctx->mask_relations)
+		return;
+
+	/*
+	 * Temporary relations, whose OIDs differ between sessions, and relations
+	 * matching the masking patterns are identified by their masked names.
+	 * Their names and persistence are cached per backend.
+	 */
+	if (ctx->flags & (PGSP_MASK_TEMP_SCHEMAS | PGSP_MASK_RELNAMES))
+	{
+		pgspRelationEntry *rel = relation_cache_find(rte->relid);
+		const char *name = NULL;
+
+		if (rel && (ctx->flags & PGSP_MASK_TEMP_SCHEMAS) && rel->istemp)
+			name = NameStr(rel->relname);
+
+		if (rel && (ctx->flags & PGSP_MASK_RELNAMES))
+		{
+			const char *relname = NameStr(rel->relname);
+			const char *masked = pgsp_mask_relation_name(relname);
+
+			if (masked != relname)
+				name = masked;
+		}
+
+		if (name)
+		{
+			pgsp_jumble_append(js, (const unsigned char *) name,
+							   strlen(name) + 1);
+			return;
+		}
+	}
+
+	APP_JUMB(rte->relid);
+}
+
+/*
+ * relation_cache_find: find or create the cache entry of a relation
+ *
+ * Returns NULL if the relation no longer exists.
+ */
+static pgspRelationEntry *
+relation_cache_find(Oid relid)
+{
+	pgspRelationEntry *entry;
+	char	   *relname;
+	bool		istemp;
+
+	if (relation_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(pgspRelationEntry);
+		relation_cache = hash_create("pg_store_plans relation cache", 256,
+									 &ctl, HASH_ELEM | HASH_BLOBS);
+		CacheRegisterRelcacheCallback(relation_cache_invalidate, (Datum) 0);
+	}
+
+	entry = (pgspRelationEntry *)
+		hash_search(relation_cache, &relid, HASH_FIND, NULL);
+	if (entry)
+		return entry;
+
+	/* Invalidations may be processed here, so enter the entry afterwards */
+	relname = get_rel_name(relid);
+	if (relname == NULL)
+		return NULL;
+	istemp = (get_rel_persistence(relid) == RELPERSISTENCE_TEMP);
+
+	entry = (pgspRelationEntry *)
+		hash_search(relation_cache, &relid, HASH_ENTER, NULL);
+	entry->istemp = istemp;
+	namestrcpy(&entry->relname, relname);
+	pfree(relname);
+
+	return entry;
+}
+
+/*
+ * relation_cache_invalidate: relcache callback to remove cache entries
+ *
+ * relid is InvalidOid when all relations are to be forgotten.
+ */
+static void
+relation_cache_invalidate(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgspRelationEntry *entry;
+
+	if (relation_cache == NULL)
+		return;
+
+	if (OidIsValid(relid))
+	{
+		hash_search(relation_cache, &relid, HASH_REMOVE, NULL);
+		return;
+	}
+
+	hash_seq_init(&hash_seq, relation_cache);
+	while ((entry = (pgspRelationEntry *) hash_seq_search(&hash_seq)) != NULL)
+		hash_search(relation_cache, &entry->relid, HASH_REMOVE, NULL);
+}
+
+/*
+ * jumble_index: jumble an index unless relations are masked
+ */
+static void
+jumble_index(pgspTreeJumble *ctx, Oid indexid)
+{
+	pgspJumbleState *js = &ctx->js;
+
+	if (!ctx->mask_relations)
+		APP_JUMB(indexid);
+}
+
+/*
+ * jumble_folded_plans: jumble the children of an Append or MergeAppend node
+ * as a set of distinct shapes
+ *
+ * The children are jumbled separately ignoring the identities of the
+ * relations, typically partitions, they scan.  The parent relations stand for
+ * them instead.  Thus the plan id doesn't change as partitions are added,
+ * removed or pruned as long as they are scanned in the same ways.
+ */
+static void
+jumble_folded_plans(pgspTreeJumble *ctx, Bitmapset *apprelids, List *plans)
+{
+	pgspJumbleState *js = &ctx->js;
+	pgspTreeJumble *child;
+	uint64	   *hashes;
+	int			nhashes = 0;
+	int			nunique = 0;
+	int			i;
+	ListCell   *lc;
+
+	i = -1;
+	while ((i = bms_next_member(apprelids, i)) >= 0)
+		jumble_relation(ctx, i);
+
+	if (plans == NIL)
+		return;
+
+	child = (pgspTreeJumble *) palloc(sizeof(pgspTreeJumble));
+	child->pstmt = ctx->pstmt;
+	child->verbose = ctx->verbose;
+	child->flags = ctx->flags;
+	child->mask_relations = true;
+
+	hashes = (uint64 *) palloc(sizeof(uint64) * list_length(plans));
+	foreach(lc, plans)
+	{
+		pgsp_jumble_init(&child->js);
+		jumble_plan(child, (Plan *) lfirst(lc));
+		hashes[nhashes++] = pgsp_jumble_finish(&child->js, NULL);
+	}
+
+	qsort(hashes, nhashes, sizeof(uint64), uint64_cmp);
+	for (i = 0; i < nhashes; i++)
+	{
+		if (nunique == 0 || hashes[nunique - 1] != hashes[i])
+			hashes[nunique++] = hashes[i];
+	}
+	APP_JUMB(nunique);
+	APP_JUMB_ARRAY(hashes, nunique);
+
+	pfree(hashes);
+	pfree(child);
+}
+
+static int
+uint64_cmp(const void *a, const void *b)
+{
+	uint64		ua = *(const uint64 *) a;
+	uint64		ub = *(const uint64 *) b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+/*
+ * jumble_plan: jumble a plan node and its children recursively
+ *
+ * This roughly follows the properties that pgsp_json_normalize() leaves in
+ * the normalized plan.  Costs, row estimates and other unstable values are
+ * ignored.
+ */
+static void
+jumble_plan(pgspTreeJumble *ctx, Plan *plan)
+{
+	pgspJumbleState *js = &ctx->js;
+	NodeTag		tag;
+
+	/* Plan trees can be deep */
+	check_stack_depth();
+
+	if (plan == NULL)
+	{
+		tag = T_Invalid;
+		APP_JUMB(tag);
+		return;
+	}
+
+	tag = nodeTag(plan);
+	APP_JUMB(tag);
+	APP_JUMB(plan->parallel_aware);
+	jumble_expr(ctx, (Node *) plan->qual);
+	jumble_expr(ctx, (Node *) plan->initPlan);
+	if (ctx->verbose)
+		jumble_expr(ctx, (Node *) plan->targetlist);
+
+	switch (tag)
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_FunctionScan:
+		case T_ValuesScan:
+		case T_TableFuncScan:
+		case T_NamedTuplestoreScan:
+		case T_WorkTableScan:
+#if PG_VERSION_NUM >= 140000
+		case T_TidRangeScan:
+#endif
+			jumble_relation(ctx, ((Scan *) plan)->scanrelid);
+			if (tag == T_FunctionScan)
+				jumble_expr(ctx, (Node *) ((FunctionScan *) plan)->functions);
+#if PG_VERSION_NUM >= 140000
+			else if (tag == T_TidRangeScan)
+				jumble_expr(ctx,
+							(Node *) ((TidRangeScan *) plan)->tidrangequals);
+#endif
+			break;
+		case T_IndexScan:
+			{
+				IndexScan  *iscan = (IndexScan *) plan;
+
+				jumble_relation(ctx, iscan->scan.scanrelid);
+				jumble_index(ctx, iscan->indexid);
+				APP_JUMB(iscan->indexorderdir);
+				jumble_expr(ctx, (Node *) iscan->indexqualorig);
+				jumble_expr(ctx, (Node *) iscan->indexorderbyorig);
+			}
+			break;
+		case T_IndexOnlyScan:
+			{
+				IndexOnlyScan *ioscan = (IndexOnlyScan *) plan;
+
+				jumble_relation(ctx, ioscan->scan.scanrelid);
+				jumble_index(ctx, ioscan->indexid);
+				APP_JUMB(ioscan->indexorderdir);
+				jumble_expr(ctx, (Node *) ioscan->indexqual);
+				jumble_expr(ctx, (Node *) ioscan->indexorderby);
+			}
+			break;
+		case T_BitmapIndexScan:
+			{
+				BitmapIndexScan *biscan = (BitmapIndexScan *) plan;
+
+				jumble_relation(ctx, biscan->scan.scanrelid);
+				jumble_index(ctx, biscan->indexid);
+				jumble_expr(ctx, (Node *) biscan->indexqualorig);
+			}
+			break;
+		case T_BitmapHeapScan:
+			jumble_relation(ctx, ((Scan *) plan)->scanrelid);
+			jumble_expr(ctx, (Node *) ((BitmapHeapScan *) plan)->bitmapqualorig);
+			break;
+		case T_TidScan:
+			jumble_relation(ctx, ((Scan *) plan)->scanrelid);
+			jumble_expr(ctx, (Node *) ((TidScan *) plan)->tidquals);
+			break;
+		case T_SubqueryScan:
+			jumble_plan(ctx, ((SubqueryScan *) plan)->subplan);
+			break;
+		case T_CteScan:
+			APP_JUMB(((CteScan *) plan)->ctePlanId);
+			break;
+		case T_ForeignScan:
+			jumble_relation(ctx, ((Scan *) plan)->scanrelid);
+			APP_JUMB(((ForeignScan *) plan)->fs_server);
+			break;
+		case T_CustomScan:
+			jumble_relation(ctx, ((Scan *) plan)->scanrelid);
+			jumble_plan_list(ctx, ((CustomScan *) plan)->custom_plans);
+			break;
+		case T_ModifyTable:
+			{
+				ModifyTable *mt = (ModifyTable *) plan;
+				ListCell   *lc;
+
+				APP_JUMB(mt->operation);
+				APP_JUMB(mt->onConflictAction);
+				foreach(lc, mt->resultRelations)
+					jumble_relation(ctx, lfirst_int(lc));
+#if PG_VERSION_NUM < 140000
+				jumble_plan_list(ctx, mt->plans);
+#endif
+			}
+			break;
+		case T_Append:
+			if (ctx->flags & PGSP_FOLD_APPENDS)
+				jumble_folded_plans(ctx,
+#if PG_VERSION_NUM >= 120000
+									((Append *) plan)->apprelids,
+#else
+									NULL,
+#endif
+									((Append *) plan)->appendplans);
+			else
+				jumble_plan_list(ctx, ((Append *) plan)->appendplans);
+			break;
+		case T_MergeAppend:
+			{
+				MergeAppend *ma = (MergeAppend *) plan;
+
+				APP_JUMB(ma->numCols);
+				APP_JUMB_ARRAY(ma->sortColIdx, ma->numCols);
+				APP_JUMB_ARRAY(ma->sortOperators, ma->numCols);
+				if (ctx->flags & PGSP_FOLD_APPENDS)
+					jumble_folded_plans(ctx,
+#if PG_VERSION_NUM >= 120000
+										ma->apprelids,
+#else
+										NULL,
+#endif
+										ma->mergeplans);
+				else
+					jumble_plan_list(ctx, ma->mergeplans);
+			}
+			break;
+		case T_BitmapAnd:
+			jumble_plan_list(ctx, ((BitmapAnd *) plan)->bitmapplans);
+			break;
+		case T_BitmapOr:
+			jumble_plan_list(ctx, ((BitmapOr *) plan)->bitmapplans);
+			break;
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			{
+				Join	   *join = (Join *) plan;
+
+				APP_JUMB(join->jointype);
+				APP_JUMB(join->inner_unique);
+				jumble_expr(ctx, (Node *) join->joinqual);
+				if (tag == T_MergeJoin)
+					jumble_expr(ctx, (Node *) ((MergeJoin *) plan)->mergeclauses);
+				else if (tag == T_HashJoin)
+					jumble_expr(ctx, (Node *) ((HashJoin *) plan)->hashclauses);
+			}
+			break;
+		case T_Sort:
+#if PG_VERSION_NUM >= 130000
+		case T_IncrementalSort:
+#endif
+			{
+				Sort	   *sort = (Sort *) plan;
+
+				APP_JUMB(sort->numCols);
+				APP_JUMB_ARRAY(sort->sortColIdx, sort->numCols);
+				APP_JUMB_ARRAY(sort->sortOperators, sort->numCols);
+				APP_JUMB_ARRAY(sort->nullsFirst, sort->numCols);
+#if PG_VERSION_NUM >= 130000
+				if (tag == T_IncrementalSort)
+					APP_JUMB(((IncrementalSort *) plan)->nPresortedCols);
+#endif
+			}
+			break;
+		case T_Group:
+			{
+				Group	   *group = (Group *) plan;
+
+				APP_JUMB(group->numCols);
+				APP_JUMB_ARRAY(group->grpColIdx, group->numCols);
+			}
+			break;
+		case T_Agg:
+			{
+				Agg		   *agg = (Agg *) plan;
+				int			ngsets = list_length(agg->groupingSets);
+
+				APP_JUMB(agg->aggstrategy);
+				APP_JUMB(agg->aggsplit);
+				APP_JUMB(agg->numCols);
+				APP_JUMB_ARRAY(agg->grpColIdx, agg->numCols);
+				APP_JUMB(ngsets);
+			}
+			break;
+		case T_WindowAgg:
+			{
+				WindowAgg  *wagg = (WindowAgg *) plan;
+
+				APP_JUMB(wagg->partNumCols);
+				APP_JUMB_ARRAY(wagg->partColIdx, wagg->partNumCols);
+				APP_JUMB(wagg->ordNumCols);
+				APP_JUMB_ARRAY(wagg->ordColIdx, wagg->ordNumCols);
+				APP_JUMB(wagg->frameOptions);
+			}
+			break;
+		case T_Unique:
+			{
+				Unique	   *uniq = (Unique *) plan;
+
+				APP_JUMB(uniq->numCols);
+				APP_JUMB_ARRAY(uniq->uniqColIdx, uniq->numCols);
+			}
+			break;
+		case T_Gather:
+			APP_JUMB(((Gather *) plan)->num_workers);
+			APP_JUMB(((Gather *) plan)->single_copy);
+			break;
+		case T_GatherMerge:
+			{
+				GatherMerge *gm = (GatherMerge *) plan;
+
+				APP_JUMB(gm->num_workers);
+				APP_JUMB(gm->numCols);
+				APP_JUMB_ARRAY(gm->sortColIdx, gm->numCols);
+			}
+			break;
+		case T_SetOp:
+			APP_JUMB(((SetOp *) plan)->cmd);
+			APP_JUMB(((SetOp *) plan)->strategy);
+			break;
+		case T_Limit:
+			jumble_expr(ctx, ((Limit *) plan)->limitOffset);
+			jumble_expr(ctx, ((Limit *) plan)->limitCount);
+			break;
+		case T_Result:
+			jumble_expr(ctx, ((Result *) plan)->resconstantqual);
+			break;
+		default:
+			/* Nothing other than the node type matters for other nodes */
+			break;
+	}
+
+	jumble_plan(ctx, plan->lefttree);
+	jumble_plan(ctx, plan->righttree);
+}
+
+/*
+ * jumble_expr: jumble an expression tree
+ *
+ * Constants are masked in the same way as normalize_expr() does, so plans
+ * differing only in constant values get the same plan id.
+ */
+static void
+jumble_expr(pgspTreeJumble *ctx, Node *node)
+{
+	(void) jumble_expr_walker(node, (void *) ctx);
+}
+
+static bool
+jumble_expr_walker(Node *node, void *context)
+{
+	pgspTreeJumble *ctx = (pgspTreeJumble *) context;
+	pgspJumbleState *js = &ctx->js;
+	NodeTag		tag;
+
+	if (node == NULL)
+		return false;
+
+	check_stack_depth();
+
+	tag = nodeTag(node);
+	APP_JUMB(tag);
+
+	switch (tag)
+	{
+		case T_Var:
+			{
+				Var		   *var = (Var *) node;
+
+				/* Range table indexes of masked relations differ */
+				if (!ctx->mask_relations)
+					APP_JUMB(var->varno);
+				APP_JUMB(var->varattno);
+				APP_JUMB(var->varlevelsup);
+			}
+			break;
+		case T_Const:
+			/* Only the type of a constant matters */
+			APP_JUMB(((Const *) node)->consttype);
+			break;
+		case T_Param:
+			{
+				Param	   *param = (Param *) node;
+
+				APP_JUMB(param->paramkind);
+				APP_JUMB(param->paramid);
+				APP_JUMB(param->paramtype);
+			}
+			break;
+		case T_Aggref:
+			APP_JUMB(((Aggref *) node)->aggfnoid);
+			break;
+		case T_WindowFunc:
+			APP_JUMB(((WindowFunc *) node)->winfnoid);
+			break;
+		case T_FuncExpr:
+			APP_JUMB(((FuncExpr *) node)->funcid);
+			break;
+		case T_OpExpr:
+		case T_DistinctExpr:
+		case T_NullIfExpr:
+			APP_JUMB(((OpExpr *) node)->opno);
+			break;
+		case T_ScalarArrayOpExpr:
+			APP_JUMB(((ScalarArrayOpExpr *) node)->opno);
+			APP_JUMB(((ScalarArrayOpExpr *) node)->useOr);
+			break;
+		case T_BoolExpr:
+			APP_JUMB(((BoolExpr *) node)->boolop);
+			break;
+		case T_SubPlan:
+			APP_JUMB(((SubPlan *) node)->subLinkType);
+			APP_JUMB(((SubPlan *) node)->plan_id);
+			break;
+		case T_RelabelType:
+			APP_JUMB(((RelabelType *) node)->resulttype);
+			break;
+		case T_CoerceViaIO:
+			APP_JUMB(((CoerceViaIO *) node)->resulttype);
+			break;
+		case T_NullTest:
+			APP_JUMB(((NullTest *) node)->nulltesttype);
+			break;
+		case T_BooleanTest:
+			APP_JUMB(((BooleanTest *) node)->booltesttype);
+			break;
+		case T_MinMaxExpr:
+			APP_JUMB(((MinMaxExpr *) node)->op);
+			break;
+		case T_RowCompareExpr:
+			APP_JUMB(((RowCompareExpr *) node)->rctype);
+			break;
+		case T_TargetEntry:
+			APP_JUMB(((TargetEntry *) node)->resno);
+			break;
+		default:
+			break;
+	}
+
+	return expression_tree_walker(node, jumble_expr_walker, context);
+}
@@ -0,0 +1,52 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_planid.h: Definitions for plan identifier calculation
+ *
+ * Copyright (c) 2012-2024, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * IDENTIFICATION
+ *	  pg_store_plans/pgsp_planid.h
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "nodes/plannodes.h"
+#include "port/pg_crc32c.h"
+
+#define PGSP_JUMBLE_SIZE	1024	/* plan jumble buffer size */
+
+/* Flags for plan id calculation */
+#define PGSP_FOLD_APPENDS	0x01	/* fold children of Append nodes */
+#define PGSP_MASK_TEMP_SCHEMAS	0x02	/* mask temporary schemas and tables */
+#define PGSP_MASK_RELNAMES	0x04	/* mask relation names by patterns */
+
+/*
+ * Working state to calculate a hash value over a byte stream of arbitrary
+ * length using a fixed-size buffer.  A CRC of the stream is also calculated
+ * as an independent check value to detect hash collisions.
+ */
+typedef struct pgspJumbleState
+{
+	unsigned char jumble[PGSP_JUMBLE_SIZE];	/* jumble buffer */
+	Size		jumble_len;		/* # of valid bytes in jumble */
+	uint64		hash;			/* hash value of the flushed bytes */
+	pg_crc32c	check;			/* CRC of the flushed bytes */
+} pgspJumbleState;
+
+extern void pgsp_jumble_init(pgspJumbleState *js);
+extern void pgsp_jumble_append(pgspJumbleState *js,
+							   const unsigned char *item, Size size);
+extern uint64 pgsp_jumble_finish(pgspJumbleState *js, uint32 *check);
+extern uint64 pgsp_plan_fingerprint(PlannedStmt *pstmt, bool verbose,
+									int flags, uint32 *check);
+extern bool pgsp_planid_cache_lookup(PlannedStmt *pstmt, int variant,
+									 uint64 *planid, uint32 *check);
+extern void pgsp_planid_cache_store(PlannedStmt *pstmt, int variant,
+									uint64 planid, uint32 check,
+									int max_entries);
+extern bool pgsp_sample_skip(uint64 queryid, int variant, double sample_rate,
+							 bool adaptive, uint64 *planid);
+extern void pgsp_sample_verified(uint64 queryid, int variant, uint64 planid,
+								 double sample_rate, int max_entries);
+extern bool pgsp_analyze_sample(uint64 queryid, double sample_rate,
+								int min_interval, int max_entries);
@@ -0,0 +1,23 @@
+SET client_min_messages = 'error';
+CREATE EXTENSION IF NOT EXISTS pg_store_plans;
+CREATE EXTENSION IF NOT EXISTS pg_stat_statements;
+CREATE TABLE t1 (a int);
+INSERT INTO t1 (SELECT a FROM generate_series(0, 9999) a);
+
+-- entries are shared across users as set in regress_aggregate.conf
+SHOW pg_store_plans.aggregate;
+CREATE ROLE regress_pgsp_user;
+GRANT SELECT ON t1 TO regress_pgsp_user;
+SELECT pg_stat_statements_reset() IS NOT NULL AS t;
+SELECT pg_store_plans_reset();
+SELECT count(*) AS c4 FROM t1 WHERE a < 5;
+SET ROLE regress_pgsp_user;
+SELECT count(*) AS c4 FROM t1 WHERE a < 5;
+RESET ROLE;
+SELECT userid, calls, rows FROM pg_store_plans
+  WHERE queryid IN (SELECT queryid FROM pg_stat_statements
+                    WHERE query = 'SELECT count(*) AS c4 FROM t1 WHERE a < $1');
+REVOKE SELECT ON t1 FROM regress_pgsp_user;
+DROP ROLE regress_pgsp_user;
+
+DROP TABLE t1;
@@ -0,0 +1,84 @@
+SET client_min_messages = 'error';
+CREATE EXTENSION IF NOT EXISTS pg_store_plans;
+CREATE EXTENSION IF NOT EXISTS pg_stat_statements;
+CREATE TABLE t1 (a int);
+CREATE INDEX ON t1 (a);
+INSERT INTO t1 (SELECT a FROM generate_series(0, 9999) a);
+
+-- plan texts are compressed as set in regress_compress.conf
+SHOW pg_store_plans.plan_compression;
+SHOW pg_store_plans.max_plan_length;
+SELECT pg_stat_statements_reset() IS NOT NULL AS t;
+SELECT pg_store_plans_reset();
+
+-- a plan longer than max_plan_length is kept whole if its compressed form fits
+SELECT count(*) AS branches FROM (
+  SELECT a FROM t1 WHERE a = 1 UNION ALL
+  SELECT a FROM t1 WHERE a = 2 UNION ALL
+  SELECT a FROM t1 WHERE a = 3 UNION ALL
+  SELECT a FROM t1 WHERE a = 4 UNION ALL
+  SELECT a FROM t1 WHERE a = 5 UNION ALL
+  SELECT a FROM t1 WHERE a = 6 UNION ALL
+  SELECT a FROM t1 WHERE a = 7 UNION ALL
+  SELECT a FROM t1 WHERE a = 8 UNION ALL
+  SELECT a FROM t1 WHERE a = 9 UNION ALL
+  SELECT a FROM t1 WHERE a = 10 UNION ALL
+  SELECT a FROM t1 WHERE a = 11 UNION ALL
+  SELECT a FROM t1 WHERE a = 12 UNION ALL
+  SELECT a FROM t1 WHERE a = 13 UNION ALL
+  SELECT a FROM t1 WHERE a = 14 UNION ALL
+  SELECT a FROM t1 WHERE a = 15 UNION ALL
+  SELECT a FROM t1 WHERE a = 16 UNION ALL
+  SELECT a FROM t1 WHERE a = 17 UNION ALL
+  SELECT a FROM t1 WHERE a = 18 UNION ALL
+  SELECT a FROM t1 WHERE a = 19 UNION ALL
+  SELECT a FROM t1 WHERE a = 20 UNION ALL
+  SELECT a FROM t1 WHERE a = 21 UNION ALL
+  SELECT a FROM t1 WHERE a = 22 UNION ALL
+  SELECT a FROM t1 WHERE a = 23 UNION ALL
+  SELECT a FROM t1 WHERE a = 24 UNION ALL
+  SELECT a FROM t1 WHERE a = 25 UNION ALL
+  SELECT a FROM t1 WHERE a = 26 UNION ALL
+  SELECT a FROM t1 WHERE a = 27 UNION ALL
+  SELECT a FROM t1 WHERE a = 28 UNION ALL
+  SELECT a FROM t1 WHERE a = 29 UNION ALL
+  SELECT a FROM t1 WHERE a = 30 UNION ALL
+  SELECT a FROM t1 WHERE a = 31 UNION ALL
+  SELECT a FROM t1 WHERE a = 32 UNION ALL
+  SELECT a FROM t1 WHERE a = 33 UNION ALL
+  SELECT a FROM t1 WHERE a = 34 UNION ALL
+  SELECT a FROM t1 WHERE a = 35 UNION ALL
+  SELECT a FROM t1 WHERE a = 36 UNION ALL
+  SELECT a FROM t1 WHERE a = 37 UNION ALL
+  SELECT a FROM t1 WHERE a = 38 UNION ALL
+  SELECT a FROM t1 WHERE a = 39 UNION ALL
+  SELECT a FROM t1 WHERE a = 40) x;
+SET pg_store_plans.plan_format TO raw;
+SELECT length(p.plan) > 1000 AS longer_than_max
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query LIKE 'SELECT count(*) AS branches FROM%';
+RESET pg_store_plans.plan_format;
+SELECT p.plan LIKE 'Aggregate%' AS readable,
+       (length(p.plan) - length(replace(p.plan, ' on t1 ', ''))) / 7 AS scans
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query LIKE 'SELECT count(*) AS branches FROM%';
+
+-- otherwise it is truncated at max_plan_length
+SELECT count(*) AS hashed FROM t1 WHERE a::text IN (
+  md5('1'), md5('2'), md5('3'), md5('4'), md5('5'), md5('6'),
+  md5('7'), md5('8'), md5('9'), md5('10'), md5('11'), md5('12'),
+  md5('13'), md5('14'), md5('15'), md5('16'), md5('17'), md5('18'),
+  md5('19'), md5('20'), md5('21'), md5('22'), md5('23'), md5('24'),
+  md5('25'), md5('26'), md5('27'), md5('28'), md5('29'), md5('30'),
+  md5('31'), md5('32'), md5('33'), md5('34'), md5('35'), md5('36'),
+  md5('37'), md5('38'), md5('39'), md5('40'), md5('41'), md5('42'),
+  md5('43'), md5('44'), md5('45'), md5('46'), md5('47'), md5('48'),
+  md5('49'), md5('50'), md5('51'), md5('52'), md5('53'), md5('54'),
+  md5('55'), md5('56'), md5('57'), md5('58'), md5('59'), md5('60'));
+SET pg_store_plans.plan_format TO raw;
+SELECT length(p.plan)
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query LIKE 'SELECT count(*) AS hashed FROM%';
+RESET pg_store_plans.plan_format;
+
+DROP TABLE t1;
@@ -58,5 +58,170 @@ $x$
 LANGUAGE plpgsql;
 SELECT test_explain();
 DROP FUNCTION test_explain();
+
+-- plan ids calculated from plan trees
+SET pg_store_plans.plan_fingerprint TO tree;
+SELECT pg_store_plans_reset();
+SELECT count(*) FROM (SELECT * FROM t1) AS x;
+SET enable_seqscan TO false;
+SELECT count(*) FROM (SELECT * FROM t1) AS x;
+SELECT count(*) FROM (SELECT * FROM t1) AS x;
+SET enable_bitmapscan TO false;
+SELECT count(*) FROM (SELECT * FROM t1) AS x;
+SELECT count(*) FROM (SELECT * FROM t1) AS x;
+SELECT count(*) FROM (SELECT * FROM t1) AS x;
+RESET enable_seqscan;
+RESET enable_bitmapscan;
+SELECT p.calls, p.rows
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query = 'SELECT count(*) FROM (SELECT * FROM t1) AS x'
+  ORDER BY p.calls;
+RESET pg_store_plans.plan_fingerprint;
+
+-- no plan id collision is expected
+SELECT collisions FROM pg_store_plans_info;
+
+-- executions shorter than min_duration are only counted when requested
+SET pg_store_plans.min_duration TO 100000;
+SELECT pg_store_plans_reset();
+SELECT count(*) FROM t1 WHERE a < 10;
+SET pg_store_plans.count_fast_executions TO on;
+SELECT count(*) FROM t1 WHERE a < 10;
+SELECT p.planid AS first_planid
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query = 'SELECT count(*) FROM t1 WHERE a < $1' \gset
+SELECT count(*) FROM t1 WHERE a < 10;
+SELECT count(*) FROM t1 WHERE a < 10;
+SELECT p.planid = :first_planid AS first_plan, p.calls, p.rows
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query = 'SELECT count(*) FROM t1 WHERE a < $1';
+RESET pg_store_plans.count_fast_executions;
+RESET pg_store_plans.min_duration;
+
+-- statements can be filtered by roles and query ids
+SELECT pg_stat_statements_reset() IS NOT NULL AS t;
+SELECT pg_store_plans_reset();
+SELECT set_config('pg_store_plans.ignore_roles', quote_ident(current_user),
+                  false) IS NOT NULL AS t;
+SELECT count(*) AS c1 FROM t1 WHERE a <= 10;
+RESET pg_store_plans.ignore_roles;
+SELECT count(*) AS c2 FROM t1 WHERE a >= 9990;
+SELECT queryid AS tracked_queryid FROM pg_stat_statements
+  WHERE query = 'SELECT count(*) AS c2 FROM t1 WHERE a >= $1' \gset
+SET pg_store_plans.track_queryids = :'tracked_queryid';
+SELECT count(*) AS c2 FROM t1 WHERE a >= 9990;
+SELECT count(*) AS c3 FROM t1 WHERE a <> 10;
+RESET pg_store_plans.track_queryids;
+SELECT s.query, s.calls, coalesce(p.calls, 0) AS plan_calls
+  FROM pg_stat_statements s LEFT JOIN pg_store_plans p USING (queryid)
+  WHERE s.query LIKE 'SELECT count(*) AS c_ FROM t1 %'
+  ORDER BY s.query;
+-- malformed lists are rejected
+SET pg_store_plans.track_roles = 'a,,b';
+SET pg_store_plans.ignore_databases = '"db';
+SET pg_store_plans.ignore_queryids = '1,x';
+
+-- relations matching the patterns share plan ids
+CREATE TABLE etl_stage_1 (a int);
+CREATE TABLE etl_stage_2 (a int);
+SELECT pg_store_plans_reset();
+SELECT count(*) FROM etl_stage_1;
+SELECT count(*) FROM etl_stage_2;
+SELECT count(*) AS entries, count(DISTINCT p.planid) AS plans
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query LIKE 'SELECT count(*) FROM etl_stage_%';
+SET pg_store_plans.mask_relation_names = 'etl_stage_*';
+SELECT pg_store_plans_reset();
+SELECT count(*) FROM etl_stage_1;
+SELECT count(*) FROM etl_stage_2;
+SELECT count(*) AS entries, count(DISTINCT p.planid) AS plans
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query LIKE 'SELECT count(*) FROM etl_stage_%';
+RESET pg_store_plans.mask_relation_names;
+DROP TABLE etl_stage_1, etl_stage_2;
+-- temporary tables are identified by names in tree plan ids
+SET pg_store_plans.plan_fingerprint TO tree;
+SET pg_store_plans.mask_temp_schemas TO off;
+SELECT pg_store_plans_reset();
+CREATE TEMP TABLE tmp1 (a int);
+SELECT count(*) FROM tmp1;
+DROP TABLE tmp1;
+CREATE TEMP TABLE tmp1 (a int);
+SELECT count(*) FROM tmp1;
+DROP TABLE tmp1;
+SELECT count(*) AS entries, count(DISTINCT p.planid) AS plans
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query = 'SELECT count(*) FROM tmp1';
+SET pg_store_plans.mask_temp_schemas TO on;
+SELECT pg_store_plans_reset();
+CREATE TEMP TABLE tmp1 (a int);
+SELECT count(*) FROM tmp1;
+DROP TABLE tmp1;
+CREATE TEMP TABLE tmp1 (a int);
+SELECT count(*) FROM tmp1;
+DROP TABLE tmp1;
+SELECT count(*) AS entries, count(DISTINCT p.planid) AS plans
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query = 'SELECT count(*) FROM tmp1';
+RESET pg_store_plans.mask_temp_schemas;
+RESET pg_store_plans.plan_fingerprint;
+
+-- plan ids can be made insensitive to the number of partitions
+CREATE TABLE pt (a int) PARTITION BY RANGE (a);
+CREATE TABLE pt_1 PARTITION OF pt FOR VALUES FROM (0) TO (10);
+CREATE TABLE pt_2 PARTITION OF pt FOR VALUES FROM (10) TO (20);
+SET pg_store_plans.fold_appends TO off;
+SELECT pg_store_plans_reset();
+SELECT count(*) FROM pt;
+CREATE TABLE pt_3 PARTITION OF pt FOR VALUES FROM (20) TO (30);
+SELECT count(*) FROM pt;
+DROP TABLE pt_3;
+SELECT p.calls
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query = 'SELECT count(*) FROM pt'
+  ORDER BY p.calls;
+SET pg_store_plans.fold_appends TO on;
+SELECT pg_store_plans_reset();
+SELECT count(*) FROM pt;
+CREATE TABLE pt_3 PARTITION OF pt FOR VALUES FROM (20) TO (30);
+SELECT count(*) FROM pt;
+DROP TABLE pt_3;
+SELECT p.calls
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query = 'SELECT count(*) FROM pt'
+  ORDER BY p.calls;
+RESET pg_store_plans.fold_appends;
+DROP TABLE pt;
+
+-- plan texts are stored uncompressed and truncated at max_plan_length
+SHOW pg_store_plans.plan_compression;
+SELECT pg_store_plans_reset();
+SELECT count(*) AS long FROM t1 WHERE a::text = repeat('x', 6000);
+SET pg_store_plans.plan_format TO raw;
+SELECT length(p.plan)
+  FROM pg_stat_statements s JOIN pg_store_plans p USING (queryid)
+  WHERE s.query = 'SELECT count(*) AS long FROM t1 WHERE a::text = repeat($1, $2)';
+RESET pg_store_plans.plan_format;
+
+-- entries are kept per user by default, sharing the plan text
+SHOW pg_store_plans.aggregate;
+CREATE ROLE regress_pgsp_user;
+GRANT SELECT ON t1 TO regress_pgsp_user;
+SELECT pg_store_plans_reset();
+SELECT count(*) AS c4 FROM t1 WHERE a < 5;
+SET ROLE regress_pgsp_user;
+SELECT count(*) AS c4 FROM t1 WHERE a < 5;
+RESET ROLE;
+SELECT count(*) AS entries, count(DISTINCT userid) AS users,
+       sum(calls) AS calls
+  FROM pg_store_plans
+  WHERE queryid IN (SELECT queryid FROM pg_stat_statements
+                    WHERE query = 'SELECT count(*) AS c4 FROM t1 WHERE a < $1');
+SELECT count(DISTINCT plan) AS plans FROM pg_store_plans
+  WHERE queryid IN (SELECT queryid FROM pg_stat_statements
+                    WHERE query = 'SELECT count(*) AS c4 FROM t1 WHERE a < $1');
+REVOKE SELECT ON t1 FROM regress_pgsp_user;
+DROP ROLE regress_pgsp_user;
+
 DROP TABLE t1;
 